@@ -29,17 +29,30 @@ THE SOFTWARE.
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/sleep.h>
+#include <avr/pgmspace.h>
 #include <util/atomic.h>
 
 #include "i2c.h"
 #include "accel.h"
+#include "dispatch.h"
 
 /* configuration */
 /* horizon trigger threshold ~0.75g and duration 15*10ms */
 #define HORIZON_THRESHOLD 48
 #define HORIZON_DURATION 15
-/* shake detect trashold ~2g */
-#define SHAKE_THRESHOLD 120
+/* shake/tap detection on z, threshold ~2g (0.5g steps); click must be
+ * shorter than 80ms (0.5ms steps), second click of a double click
+ * 100ms..355ms after the first one (1ms steps) */
+#define CLICK_THRESHOLD 4
+#define CLICK_TIMELIMIT 160
+#define CLICK_LATENCY 100
+#define CLICK_WINDOW 255
+/* tilt selection: step when tilted by more than ~30° (0.5g, 18mg/digit),
+ * rearm below ~15° and repeat every 50 samples (0.5 s at 100 Hz) while the
+ * device is held tilted */
+#define TILT_ON 28
+#define TILT_OFF 14
+#define TILT_REPEAT 50
 
 /* device address */
 #define LIS302DL 0b00111000
@@ -49,49 +62,96 @@ THE SOFTWARE.
 #define LIS302DL_CTRLREG2 0x21
 #define LIS302DL_CTRLREG3 0x22
 #define LIS302DL_UNUSED1 0x28
+#define LIS302DL_OUTX 0x29
 #define LIS302DL_OUTZ 0x2D
 #define LIS302DL_FFWUCFG1 0x30
 #define LIS302DL_FFWUTHS1 0x32
 #define LIS302DL_FFWUCFG2 0x34
 #define LIS302DL_FFWUTHS2 0x36
+#define LIS302DL_CLICKCFG 0x38
+#define LIS302DL_CLICKSRC 0x39
+#define LIS302DL_CLICKTHSZ 0x3C
 
 /* bit positions in registers, see chip docs */
+#define XEN 0
+#define YEN 1
+/* int1 source select in ctrl_reg3 */
+#define I1CFG_MASK 0b111
+#define I1CFG_FFWU1 0b001
+#define I1CFG_DATAREADY 0b100
 #define ZHIE 5
+#define LIR 6
+#define DOUBLE_Z 5
+#define SINGLE_Z 4
+
+/* register configuration, see twScript */
+static const uint8_t startScript[] PROGMEM = {
+	/* disable power-down-mode, enable z-axis
+	 * defaults
+	 * push-pull, low-active, click on int2, FF_WU_1 on int1 */
+	LIS302DL_CTRLREG1, 3, 0b01000100, 0b0, 0b10111001,
+	/* set up ff_wu_1 (horizon detection): interrupt on z high event */
+	LIS302DL_FFWUCFG1, 1, 1 << ZHIE,
+	LIS302DL_FFWUTHS1, 2, HORIZON_THRESHOLD, HORIZON_DURATION,
+	/* set up click detection (shake): latch until CLICK_SRC is read, single
+	 * and double click on z */
+	LIS302DL_CLICKCFG, 1, (1 << LIR) | (1 << DOUBLE_Z) | (1 << SINGLE_Z),
+	LIS302DL_CLICKTHSZ, 4, CLICK_THRESHOLD, CLICK_TIMELIMIT, CLICK_LATENCY,
+			CLICK_WINDOW,
+	TW_SCRIPT_END,
+};
+/* shadow copy of registers 0x20..0x3f */
+static uint8_t regs[TW_SHADOW_MAX];
+#define reg(x) regs[(x)-LIS302DL_CTRLREG1]
 
 static int8_t zval;
-static uint8_t shakeCount = 0;
+/* x, unused, y, unused, z */
+static int8_t tiltval[5];
+static uint8_t clicksrc;
+static uint8_t shakeCount = 0, doubleTapCount = 0;
 
 /* horizon position */
 /* current */
 static horizon horizonSign = HORIZON_NONE;
 static bool horizonChanged = false;
 
+/* tilt selection requested/configured, steps and number of samples the
+ * device has been tilted (0 if level) */
+static bool tiltWanted = false, tiltEnabled = false;
+static int16_t tiltTicks = 0;
+static uint8_t tiltHeld = 0;
+
+/* PINC at the last pin change, int1/int2 idle high */
+static uint8_t intPins = (1 << PINC0) | (1 << PINC1);
+
 /* driver state */
 #define STOPPED 0
 #define START_REQUEST 1
-#define STARTING_A 2
-#define STARTING_B 3
-#define STARTING_C 4
-#define STARTING_D 5
-#define STARTING_E 6
-#define STARTING_F 7
+#define STARTING 2
+#define CONFIGURING 3
 #define STOP_REQUEST 8
 #define STOPPING 9
 #define READING 10
 #define IDLE 11
+#define READING_CLICK 12
+#define READING_TILT 13
 static uint8_t state = STOPPED;
+/* an i2c request failed */
+static volatile bool i2cFailed = false;
 
-/* data ready interrupt
+/* horizon or data ready (int1) and click (int2) interrupt; blocking, since
+ * intPins must be compared and updated in one go
  */
 ISR(PCINT1_vect) {
 	const uint8_t pin = PINC;
-	/* low-active */
-	const bool int1 = !((pin >> PINC0) & 0x1);
-	const bool int2 = !((pin >> PINC1) & 0x1);
-	if (int1) {
+	/* low-active, only falling edges are new interrupts; rising ones
+	 * are releases by reading the device or the other line toggling */
+	const uint8_t fell = intPins & ~pin;
+	intPins = pin;
+	if ((fell >> PINC0) & 0x1) {
 		enableWakeup (WAKE_ACCEL_HORIZON);
 	}
-	if (int2) {
+	if ((fell >> PINC1) & 0x1) {
 		enableWakeup (WAKE_ACCEL_SHAKE);
 	}
 }
@@ -112,120 +172,193 @@ void accelStart () {
 	enableWakeup (WAKE_ACCEL_HORIZON);
 }
 
+/*	Enable/disable tilt selection. This enables the x and y axis and moves
+ *	int1 from horizon detection to data ready, the horizon is derived from
+ *	the sample data instead.
+ */
+void accelSetTilt (const bool enable) {
+	tiltWanted = enable;
+	tiltTicks = 0;
+	/* reconfigured by IDLE */
+	dispatchRequest (accelProcess);
+}
+
+/*	i2c request finished, remember failures of intermediate requests too
+ */
+static void accelI2cCheck (const twStatus status) {
+	if (status != TWST_OK) {
+		i2cFailed = true;
+	}
+}
+
+static void accelI2cDone (const twStatus status) {
+	accelI2cCheck (status);
+	enableWakeup (WAKE_ACCEL_I2C);
+}
+
+static void accelSetHorizon (const horizon next) {
+	if (horizonSign != next) {
+		horizonChanged = true;
+	}
+	horizonSign = next;
+}
+
+/*	Turn tilt sample into steps
+ */
+static void accelProcessTilt () {
+	/* use the axis tilted most */
+	const int8_t x = tiltval[0], y = tiltval[2], z = tiltval[4];
+	const int8_t t = abs (x) >= abs (y) ? x : y;
+	const int16_t a = abs (t);
+
+	if (tiltHeld == 0) {
+		if (a > TILT_ON) {
+			tiltTicks += t > 0 ? 1 : -1;
+			tiltHeld = 1;
+		}
+	} else if (a < TILT_OFF) {
+		tiltHeld = 0;
+	} else {
+		++tiltHeld;
+		if (tiltHeld > TILT_REPEAT && a > TILT_ON) {
+			tiltTicks += t > 0 ? 1 : -1;
+			tiltHeld = 1;
+		}
+	}
+
+	/* same threshold as the horizon interrupt, keep the last horizon while
+	 * the device is on its side */
+	if (z >= HORIZON_THRESHOLD) {
+		accelSetHorizon (HORIZON_POS);
+	} else if (z <= -HORIZON_THRESHOLD) {
+		accelSetHorizon (HORIZON_NEG);
+	}
+}
+
 void accelProcess () {
+	const uint8_t prev = state;
 	switch (state) {
-		case START_REQUEST: {
-			/* configuration:
-			 * disable power-down-mode, enable z-axis
-			 */
-			static uint8_t data[] = {0b01000100};
-
-			if (twRequest (TWM_WRITE, LIS302DL, LIS302DL_CTRLREG1, data,
-					length (data))) {
-				state = STARTING_A;
+		case START_REQUEST:
+			i2cFailed = false;
+			tiltEnabled = false;
+			if (twScript (LIS302DL, regs, LIS302DL_CTRLREG1, startScript,
+					accelI2cCheck, accelI2cDone)) {
+				state = STARTING;
 			}
 			break;
-		}
 
-		/* set up ff_wu_1 (horizon detection) */
-		case STARTING_A:
-			if (shouldWakeup (WAKE_I2C)) {
-				disableWakeup (WAKE_I2C);
-				static uint8_t data[] = {HORIZON_THRESHOLD, HORIZON_DURATION};
-				if (twRequest (TWM_WRITE, LIS302DL, LIS302DL_FFWUTHS1, data,
-						length (data))) {
-					state = STARTING_B;
+		case STARTING:
+			if (shouldWakeup (WAKE_ACCEL_I2C)) {
+				disableWakeup (WAKE_ACCEL_I2C);
+				if (i2cFailed) {
+					/* bus was reset, start over */
+					state = START_REQUEST;
+				} else {
+					state = IDLE;
 				}
 			}
 			break;
 
-		case STARTING_B:
-			if (shouldWakeup (WAKE_I2C)) {
-				disableWakeup (WAKE_I2C);
-				/* enable interrupt on z high event */
-				static uint8_t data[] = {1 << ZHIE};
-				if (twRequest (TWM_WRITE, LIS302DL, LIS302DL_FFWUCFG1, data,
-						length (data))) {
-					state = STARTING_C;
+		case CONFIGURING:
+			if (shouldWakeup (WAKE_ACCEL_I2C)) {
+				disableWakeup (WAKE_ACCEL_I2C);
+				state = IDLE;
+				if (i2cFailed) {
+					/* retried by IDLE, see below */
+					i2cFailed = false;
+					break;
 				}
+				tiltEnabled = (reg (LIS302DL_CTRLREG1) >> XEN) & 0x1;
+				tiltHeld = 0;
+				/* read current data, which also resets data ready */
+				enableWakeup (WAKE_ACCEL_HORIZON);
 			}
 			break;
 
-		/* set up ff_wu_2 (shake detection) */
-		case STARTING_C:
-			if (shouldWakeup (WAKE_I2C)) {
-				disableWakeup (WAKE_I2C);
-				static uint8_t data[] = {SHAKE_THRESHOLD};
-				if (twRequest (TWM_WRITE, LIS302DL, LIS302DL_FFWUTHS2, data,
-						length (data))) {
-					state = STARTING_D;
+		case IDLE:
+			/* reconfigure or read new data from the device buffer, if the
+			 * request was queued */
+			if (tiltWanted != tiltEnabled) {
+				const uint8_t axes = (1 << XEN) | (1 << YEN);
+				uint8_t * const ctrl1 = &reg (LIS302DL_CTRLREG1);
+				uint8_t * const ctrl3 = &reg (LIS302DL_CTRLREG3);
+				*ctrl1 = tiltWanted ? *ctrl1 | axes : *ctrl1 & ~axes;
+				*ctrl3 = (*ctrl3 & ~I1CFG_MASK) |
+						(tiltWanted ? I1CFG_DATAREADY : I1CFG_FFWU1);
+				/* ctrl_reg1..3 */
+				if (twRequest (TWM_WRITE, LIS302DL, LIS302DL_CTRLREG1, ctrl1,
+						3, accelI2cDone)) {
+					state = CONFIGURING;
 				}
+			} else if (tiltEnabled && shouldWakeup (WAKE_ACCEL_HORIZON) &&
+					twRequest (TWM_READ, LIS302DL, LIS302DL_OUTX,
+					(uint8_t *) tiltval, sizeof (tiltval), accelI2cDone)) {
+				/* new sample, the horizon is derived from it as well */
+				disableWakeup (WAKE_ACCEL_HORIZON);
+				state = READING_TILT;
+			} else if (!tiltEnabled && shouldWakeup (WAKE_ACCEL_HORIZON) && twRequest (TWM_READ, LIS302DL,
+						LIS302DL_OUTZ, (uint8_t *) &zval, sizeof (zval),
+						accelI2cDone)) {
+				disableWakeup (WAKE_ACCEL_HORIZON);
+				state = READING;
+			} else if (shouldWakeup (WAKE_ACCEL_SHAKE) && twRequest (TWM_READ,
+						LIS302DL, LIS302DL_CLICKSRC, &clicksrc,
+						sizeof (clicksrc), accelI2cDone)) {
+				/* reading CLICK_SRC releases int2 */
+				disableWakeup (WAKE_ACCEL_SHAKE);
+				state = READING_CLICK;
 			}
 			break;
 
-		case STARTING_D:
-			if (shouldWakeup (WAKE_I2C)) {
-				disableWakeup (WAKE_I2C);
-				/* or events, enable interrupt on z high event */
-				static uint8_t data[] = {1 << ZHIE};
-				if (twRequest (TWM_WRITE, LIS302DL, LIS302DL_FFWUCFG2, data,
-						length (data))) {
-					state = STARTING_E;
+		case READING_CLICK:
+			if (shouldWakeup (WAKE_ACCEL_I2C)) {
+				disableWakeup (WAKE_ACCEL_I2C);
+				state = IDLE;
+
+				if (i2cFailed) {
+					i2cFailed = false;
+					enableWakeup (WAKE_ACCEL_SHAKE);
+					break;
 				}
-			}
-			break;
 
-		case STARTING_E:
-			if (shouldWakeup (WAKE_I2C)) {
-				disableWakeup (WAKE_I2C);
-				/* push-pull, low-active, FF_WU_1 on int1, FF_WU_2 on int2 */
-				static uint8_t data[] = {0b10010001};
-				if (twRequest (TWM_WRITE, LIS302DL, LIS302DL_CTRLREG3, data,
-						length (data))) {
-					state = STARTING_F;
+				/* the sensor classified the gesture already */
+				if (clicksrc & (1 << SINGLE_Z)) {
+					++shakeCount;
+				}
+				if (clicksrc & (1 << DOUBLE_Z)) {
+					++doubleTapCount;
 				}
 			}
 			break;
 
-		case STARTING_F:
-			if (shouldWakeup (WAKE_I2C)) {
-				disableWakeup (WAKE_I2C);
+		case READING:
+			if (shouldWakeup (WAKE_ACCEL_I2C)) {
+				disableWakeup (WAKE_ACCEL_I2C);
 				state = IDLE;
-			}
-			break;
 
-		case IDLE:
-			/* new data available in device buffer and bus is free */
-			if (shouldWakeup (WAKE_ACCEL_HORIZON) && twRequest (TWM_READ, LIS302DL,
-						LIS302DL_OUTZ, (uint8_t *) &zval, sizeof (zval))) {
-				disableWakeup (WAKE_ACCEL_HORIZON);
-				state = READING;
-			}
-			if (shouldWakeup (WAKE_ACCEL_SHAKE)) {
-				disableWakeup (WAKE_ACCEL_SHAKE);
-				++shakeCount;
+				if (i2cFailed) {
+					/* try again */
+					i2cFailed = false;
+					enableWakeup (WAKE_ACCEL_HORIZON);
+					break;
+				}
+
+				accelSetHorizon (zval >= 0 ? HORIZON_POS : HORIZON_NEG);
 			}
 			break;
 
-		case READING:
-			if (shouldWakeup (WAKE_I2C)) {
-				disableWakeup (WAKE_I2C);
-				/* the bus might be in use again already */
-				//assert (twr.status == TWST_OK);
-
-				if (zval >= 0) {
-					if (horizonSign != HORIZON_POS) {
-						horizonChanged = true;
-					}
-					horizonSign = HORIZON_POS;
-				} else {
-					if (horizonSign != HORIZON_NEG) {
-						horizonChanged = true;
-					}
-					horizonSign = HORIZON_NEG;
+		case READING_TILT:
+			if (shouldWakeup (WAKE_ACCEL_I2C)) {
+				disableWakeup (WAKE_ACCEL_I2C);
+				state = IDLE;
+
+				if (i2cFailed) {
+					i2cFailed = false;
+					enableWakeup (WAKE_ACCEL_HORIZON);
+					break;
 				}
 
-				state = IDLE;
+				accelProcessTilt ();
 			}
 			break;
 
@@ -233,6 +366,12 @@ void accelProcess () {
 			assert (0);
 			break;
 	}
+
+	/* a reconfiguration requested while a transfer was running waited for
+	 * idle, run it on the next pass */
+	if (state == IDLE && prev != IDLE && tiltWanted != tiltEnabled) {
+		dispatchRequest (accelProcess);
+	}
 }
 
 horizon accelGetHorizon (bool * const changed) {
@@ -241,11 +380,30 @@ horizon accelGetHorizon (bool * const changed) {
 	return horizonSign;
 }
 
+/*	Number of single taps/shakes
+ */
 uint8_t accelGetShakeCount () {
-	return shakeCount/2;
+	return shakeCount;
+}
+
+/*	Number of double taps, the first tap is counted as single tap too
+ */
+uint8_t accelGetDoubleTapCount () {
+	return doubleTapCount;
 }
 
 void accelResetShakeCount () {
 	shakeCount = 0;
+	doubleTapCount = 0;
+}
+
+/*	Tilt steps since the last reset, positive if tilted towards +x/+y
+ */
+int16_t accelGetTiltTicks () {
+	return tiltTicks;
+}
+
+void accelResetTiltTicks () {
+	tiltTicks = 0;
 }
 
@@ -39,6 +39,10 @@ void accelProcess ();
 horizon accelGetHorizon (bool * const);
 void accelResetShakeCount ();
 uint8_t accelGetShakeCount ();
+uint8_t accelGetDoubleTapCount ();
+void accelSetTilt (const bool);
+int16_t accelGetTiltTicks ();
+void accelResetTiltTicks ();
 
 #endif /* ACCEL_H */
 
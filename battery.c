@@ -0,0 +1,190 @@
+/*
+Copyright (c) 2014-2015
+	Lars-Dominik Braun <lars@6xq.net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/*	Battery monitor
+ *
+ *	Vcc is measured against the internal 1.1 V bandgap once a minute: the
+ *	adc uses Vcc as reference and converts the bandgap, thus
+ *	Vcc = 1.1 V*1024/ADC. The first conversion after switching to the
+ *	bandgap is discarded while it settles, the second one is used, i.e.
+ *	the adc is on for 38 adc cycles (~300 us). Readings are smoothed by an
+ *	exponential moving average and mapped to a level with hysteresis.
+ */
+
+#include "common.h"
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <stdio.h>
+#include <util/atomic.h>
+
+#include "battery.h"
+#include "timer.h"
+#include "power.h"
+#include "clock.h"
+
+/* measurement interval (ms) */
+#define BATTERY_INTERVAL ((uint32_t) 60*1000)
+/* nominal bandgap voltage (mV), the datasheet allows 1.0 to 1.2 V */
+#define BATTERY_BANDGAP 1100
+/* average weight of a new reading is 1/2^BATTERY_SHIFT; avg holds
+ * millivolts<<BATTERY_SHIFT, which fits 16 bits up to 8 V */
+#define BATTERY_SHIFT 3
+/* level thresholds (mV), the sensors need at least 2.4 V */
+#define BATTERY_LOW_MV 2900
+#define BATTERY_CRITICAL_MV 2600
+/* a level is left only this far above its threshold (mV) */
+#define BATTERY_HYSTERESIS 50
+
+/* bandgap input, vcc reference */
+#define ADMUX_BANDGAP ((1 << REFS0) | (1 << MUX3) | (1 << MUX2) | (1 << MUX1))
+
+#if CLOCK_ADPS (CLOCK_HZ (CLOCK_FAST)) == 0
+#error "cpu speed not supported"
+#endif
+static const uint8_t adps[CLOCK_SPEEDS] = {CLOCK_ADPS (CLOCK_HZ (CLOCK_SLOW)),
+		CLOCK_ADPS (CLOCK_HZ (CLOCK_FAST))};
+/* entry threshold of each level */
+static const uint16_t thresholds[BATTERY_LEVELS] = {UINT16_MAX,
+		BATTERY_LOW_MV, BATTERY_CRITICAL_MV};
+
+/* adc is acquired and the clock frozen during a measurement */
+static bool held = false, frozen = false;
+/* conversions left to discard */
+static uint8_t discard = 0;
+/* average, 0 if there was no reading yet */
+static uint16_t avg = 0;
+static volatile batteryLevel level = BATTERY_OK;
+#ifdef BATTERY_PROFILE
+/* lowest reading and readings since the last dump */
+static uint16_t lowest = UINT16_MAX, readings = 0;
+#endif
+
+/*	Start a measurement, called from timer interrupt
+ */
+static void batteryMeasure () {
+	if (held) {
+		return;
+	}
+	powerHold (POWER_ADC, &held, true);
+	/* the adc clock divider is fixed until the conversion is done */
+	clockFreeze (&frozen, true);
+	discard = 1;
+	ADMUX = ADMUX_BANDGAP;
+	ADCSRA = (1 << ADEN) | (1 << ADSC) | (1 << ADIE) |
+			adps[clockCurrent ()];
+}
+
+/*	Map average to a level, moving at most one level per reading
+ */
+static void batteryUpdateLevel () {
+	const uint16_t mv = avg >> BATTERY_SHIFT;
+	if (level < BATTERY_LEVELS-1 && mv < thresholds[level+1]) {
+		++level;
+	} else if (level > BATTERY_OK &&
+			mv >= thresholds[level] + BATTERY_HYSTERESIS) {
+		--level;
+	}
+}
+
+/*	Conversion done; the division takes about 0.5 ms at 1 MHz, the pwm
+ *	interrupt must not wait for it
+ */
+ISR(ADC_vect, ISR_NOBLOCK) {
+	if (discard > 0) {
+		--discard;
+		ADCSRA |= (1 << ADSC);
+		return;
+	}
+	const uint16_t result = ADC;
+	/* must be disabled before gating */
+	ADCSRA = 0;
+	powerHold (POWER_ADC, &held, false);
+	clockFreeze (&frozen, false);
+
+	if (result == 0) {
+		return;
+	}
+	const uint16_t mv = ((uint32_t) BATTERY_BANDGAP*1024 + result/2)/result;
+	if (avg == 0) {
+		avg = mv << BATTERY_SHIFT;
+	} else {
+		avg = avg - (avg >> BATTERY_SHIFT) + mv;
+	}
+	batteryUpdateLevel ();
+#ifdef BATTERY_PROFILE
+	if (mv < lowest) {
+		lowest = mv;
+	}
+	++readings;
+#endif
+}
+
+void batteryInit () {
+	timerSetCallback (TIMER_BATTERY, batteryMeasure);
+}
+
+/*	Measure now and every BATTERY_INTERVAL
+ */
+void batteryStart () {
+	ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+		batteryMeasure ();
+	}
+	timerStart (TIMER_BATTERY, BATTERY_INTERVAL, false);
+}
+
+/*	Stop measuring, a running measurement finishes
+ */
+void batteryStop () {
+	timerStop (TIMER_BATTERY);
+}
+
+/*	Average supply voltage (mV), 0 if unknown
+ */
+uint16_t batteryGetMillivolts () {
+	uint16_t ret;
+	ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+		ret = avg >> BATTERY_SHIFT;
+	}
+	return ret;
+}
+
+batteryLevel batteryGetLevel () {
+	return level;
+}
+
+#ifdef BATTERY_PROFILE
+/*	Print average and lowest reading (mV) and level, reset the lowest
+ */
+void batteryDump () {
+	uint16_t l, n;
+	ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+		l = lowest;
+		n = readings;
+		lowest = UINT16_MAX;
+		readings = 0;
+	}
+	printf ("battery %u mV lowest %u mV level %u readings %u\n",
+			batteryGetMillivolts (), l, level, n);
+}
+#endif
@@ -0,0 +1,52 @@
+/*
+Copyright (c) 2014-2015
+	Lars-Dominik Braun <lars@6xq.net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef BATTERY_H
+#define BATTERY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* supply level, the ui and drivers degrade with it */
+typedef uint8_t batteryLevel;
+/* full performance */
+#define BATTERY_OK 0
+/* dimmer LEDs, shorter alarm, gyro stays at the low rate */
+#define BATTERY_LOW 1
+/* even dimmer LEDs and shorter alarm, finish the running countdown */
+#define BATTERY_CRITICAL 2
+#define BATTERY_LEVELS 3
+
+void batteryInit ();
+void batteryStart ();
+void batteryStop ();
+uint16_t batteryGetMillivolts ();
+batteryLevel batteryGetLevel ();
+
+/* define BATTERY_PROFILE (i.e. make CFLAGS+=-DBATTERY_PROFILE) to track the
+ * lowest reading, see batteryDump */
+#ifdef BATTERY_PROFILE
+void batteryDump ();
+#endif
+
+#endif /* BATTERY_H */
@@ -0,0 +1,122 @@
+/*
+Copyright (c) 2014-2015
+	Lars-Dominik Braun <lars@6xq.net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/*	Clock manager
+ *
+ *	The cpu waits at F_CPU and runs at CLOCK_SCALE times that while anyone
+ *	holds the fast clock, i.e. during i2c transfers and gyro batches: work
+ *	finishes sooner and the cpu returns to sleep. Every peripheral keeps
+ *	its timing across a switch: timer prescalers are scaled along with
+ *	CLKPR, TWBR and the speaker’s compare value are reprogrammed. The usart
+ *	is asynchronous, it freezes the clock while transmitting and sets up
+ *	UBRR for the current speed when it is acquired.
+ */
+
+#include "common.h"
+
+#include <avr/io.h>
+#include <avr/power.h>
+#include <util/atomic.h>
+
+#include "clock.h"
+#include "timer.h"
+#include "pwm.h"
+#include "speaker.h"
+#include "i2c.h"
+
+/* fast clock holders and freezers */
+static uint8_t fastRefs = 0, frozenRefs = 0;
+static clockSpeed speed = CLOCK_SLOW;
+
+#if CLOCK_SCALE > 1
+static const uint8_t clkpr[CLOCK_SPEEDS] = {CLOCK_CLKPR (CLOCK_HZ (CLOCK_SLOW)),
+		CLOCK_CLKPR (CLOCK_HZ (CLOCK_FAST))};
+#endif
+
+/*	Switch to the speed requested, unless frozen. Interrupts must be
+ *	disabled.
+ */
+static void clockUpdate () {
+#if CLOCK_SCALE > 1
+	const clockSpeed want = fastRefs > 0 ? CLOCK_FAST : CLOCK_SLOW;
+	if (want == speed || frozenRefs > 0) {
+		return;
+	}
+	/* timed sequence, the second write must follow within four cycles;
+	 * clock_prescale_set loads the value before the first one */
+	clock_prescale_set ((clock_div_t) clkpr[want]);
+	speed = want;
+	timerClock (want);
+	pwmClock (want);
+	speakerClock (want);
+	twClock (want);
+#endif
+}
+
+void clockInit () {
+	clock_prescale_set ((clock_div_t) CLOCK_CLKPR (F_CPU));
+	speed = CLOCK_SLOW;
+}
+
+/*	Hold the fast clock or drop it, depending on need, if held does not
+ *	match
+ */
+void clockHold (bool * const held, const bool need) {
+	ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+		if (need && !*held) {
+			assert (fastRefs < UINT8_MAX);
+			++fastRefs;
+			*held = true;
+			clockUpdate ();
+		} else if (!need && *held) {
+			assert (fastRefs > 0);
+			--fastRefs;
+			*held = false;
+			clockUpdate ();
+		}
+	}
+}
+
+/*	Defer speed changes while frozen, the pending one is applied when the
+ *	last freezer leaves
+ */
+void clockFreeze (bool * const frozen, const bool need) {
+	ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+		if (need && !*frozen) {
+			assert (frozenRefs < UINT8_MAX);
+			++frozenRefs;
+			*frozen = true;
+		} else if (!need && *frozen) {
+			assert (frozenRefs > 0);
+			--frozenRefs;
+			*frozen = false;
+			clockUpdate ();
+		}
+	}
+}
+
+/*	Current speed, stable while interrupts are disabled or frozen
+ */
+clockSpeed clockCurrent () {
+	return speed;
+}
@@ -0,0 +1,90 @@
+/*
+Copyright (c) 2014-2015
+	Lars-Dominik Braun <lars@6xq.net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "common.h"
+
+/* the cpu runs from the internal rc oscillator, divided by 2^CLKPR */
+#define CLOCK_RC 8000000UL
+
+/* F_CPU is the slow clock used while waiting; bursts run at CLOCK_SCALE
+ * times that. Timer0/1 prescalers are 1, 8, 64, 256 and 1024, so only a
+ * factor of four keeps the timer service tick when switching (256 to 1024). */
+#if 4*F_CPU <= CLOCK_RC
+#define CLOCK_SCALE 4
+#else
+#define CLOCK_SCALE 1
+#endif
+
+/* clock speeds */
+typedef uint8_t clockSpeed;
+#define CLOCK_SLOW 0
+#define CLOCK_FAST 1
+#define CLOCK_SPEEDS 2
+
+/* frequency (Hz) of speed s */
+#define CLOCK_HZ(s) ((s) == CLOCK_FAST ? F_CPU*CLOCK_SCALE : F_CPU)
+
+/* CLKPR value for frequency f, 0xff if unsupported */
+#define CLOCK_CLKPR(f) ((f) == CLOCK_RC ? 0 : (f) == CLOCK_RC/2 ? 1 : \
+		(f) == CLOCK_RC/4 ? 2 : (f) == CLOCK_RC/8 ? 3 : \
+		(f) == CLOCK_RC/16 ? 4 : (f) == CLOCK_RC/32 ? 5 : \
+		(f) == CLOCK_RC/64 ? 6 : (f) == CLOCK_RC/128 ? 7 : \
+		(f) == CLOCK_RC/256 ? 8 : 0xff)
+#if CLOCK_CLKPR (F_CPU) == 0xff
+#error "F_CPU must be the rc oscillator divided by a power of two"
+#endif
+
+/* clock select bits of timer0/timer1 for divider d, 0 if unsupported */
+#define CLOCK_CS01(d) ((d) == 1 ? 1 : (d) == 8 ? 2 : (d) == 64 ? 3 : \
+		(d) == 256 ? 4 : (d) == 1024 ? 5 : 0)
+/* timer2 has two more */
+#define CLOCK_CS2(d) ((d) == 1 ? 1 : (d) == 8 ? 2 : (d) == 32 ? 3 : \
+		(d) == 64 ? 4 : (d) == 128 ? 5 : (d) == 256 ? 6 : (d) == 1024 ? 7 : 0)
+
+/* UBRR for baud rate b at frequency f, double speed mode, rounded */
+#define CLOCK_UBRR(f, b) (((f) + 4*(b))/(8*(b)) - 1)
+/* actual baud rate */
+#define CLOCK_BAUD(f, b) ((f)/(8*(CLOCK_UBRR (f, b) + 1)))
+
+/* TWBR for at most scl Hz at frequency f with prescaler 1; scl is
+ * f/(16+2*TWBR), rounded towards the slower clock. TWBR=0 yields f/16. */
+#define CLOCK_TWBR(f, scl) ((f) > 16*(scl) ? \
+		((f) - 16*(scl) + 2*(scl) - 1)/(2*(scl)) : 0)
+
+/* ADPS for an adc clock of at most 200 kHz at frequency f, 0 if too fast */
+#define CLOCK_ADPS(f) ((f)/2 <= 200000 ? 1 : (f)/4 <= 200000 ? 2 : \
+		(f)/8 <= 200000 ? 3 : (f)/16 <= 200000 ? 4 : (f)/32 <= 200000 ? 5 : \
+		(f)/64 <= 200000 ? 6 : (f)/128 <= 200000 ? 7 : 0)
+
+void clockInit ();
+void clockHold (bool * const, const bool);
+void clockFreeze (bool * const, const bool);
+clockSpeed clockCurrent ();
+
+#endif /* CLOCK_H */
@@ -24,7 +24,7 @@ THE SOFTWARE.
 #ifndef COMMON_H
 #define COMMON_H
 
-/* cpu runs at n mhz */
+/* slow cpu clock (Hz), see clock.h */
 #define F_CPU 1000000
 
 #define sleepwhile(cond) \
@@ -44,25 +44,45 @@ THE SOFTWARE.
 	}
 
 #include <stdbool.h>
+#include <avr/io.h>
 
-/* global wakeup flag, incremented by functions that interact with the main
- * loop (i.e. not pwm) */
-extern volatile uint8_t wakeup;
+/* pending wakeup sources, bit i is source i, see dispatch.c. Kept in GPIOR0,
+ * which is bit-addressable: constant bits are set and cleared by a single
+ * sbi/cbi, which cannot be interrupted. */
+#define wakeup GPIOR0
 
 /* wakeup sources */
 #define WAKE_ACCEL_HORIZON 0
 #define WAKE_ACCEL_SHAKE 1
 #define WAKE_GYRO 2
-#define WAKE_I2C 3
+#define WAKE_ACCEL_I2C 3
 #define WAKE_TIMER 4
+#define WAKE_GYRO_I2C 5
+#define WAKE_TIMER_ALARM 6
+#define WAKE_ANIMATION 7
 
-#define shouldWakeup(x) (wakeup & (1 << x))
-#define enableWakeup(x) wakeup |= 1 << x;
+#define shouldWakeup(x) (wakeup & (1 << (x)))
 #include <util/atomic.h>
-#define disableWakeup(x) \
-	ATOMIC_BLOCK (ATOMIC_FORCEON) { \
-		wakeup &= ~(1 << x); \
-	}
+/* atomic, some interrupts run with interrupts enabled; variable bits need a
+ * read-modify-write */
+#define enableWakeup(x) do { \
+	if (__builtin_constant_p (x)) { \
+		wakeup |= 1 << (x); \
+	} else { \
+		ATOMIC_BLOCK (ATOMIC_RESTORESTATE) { \
+			wakeup |= 1 << (x); \
+		} \
+	} \
+} while (0)
+#define disableWakeup(x) do { \
+	if (__builtin_constant_p (x)) { \
+		wakeup &= ~(1 << (x)); \
+	} else { \
+		ATOMIC_BLOCK (ATOMIC_RESTORESTATE) { \
+			wakeup &= ~(1 << (x)); \
+		} \
+	} \
+} while (0)
 
 void shutdownError ();
 
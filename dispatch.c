@@ -0,0 +1,79 @@
+/*
+Copyright (c) 2014-2015
+	Lars-Dominik Braun <lars@6xq.net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/*	Event dispatcher
+ *
+ *	Interrupts post wakeup sources, the main loop sleeps until one is
+ *	pending and calls the handlers subscribed to it, in table order. Every
+ *	handler of a pass sees the sources pending at its start, even if an
+ *	earlier one consumed them, thus consumers of a driver’s results are
+ *	listed after the driver. Handlers consume the sources they act on;
+ *	the loop does not sleep while any is pending. Work that is not caused
+ *	by an interrupt, like a request from another handler, is scheduled with
+ *	dispatchRequest.
+ */
+
+#include "common.h"
+
+#include "dispatch.h"
+#include "power.h"
+
+static const dispatchEntry *table = NULL;
+static uint8_t entries = 0;
+/* handlers to run on the next pass regardless of events, bit i is entry i */
+static uint8_t requests = 0;
+
+/*	Run handler on the next pass. Main loop only.
+ */
+void dispatchRequest (const dispatchHandler handler) {
+	for (uint8_t i = 0; i < entries; i++) {
+		if (table[i].handler == handler) {
+			requests |= 1 << i;
+		}
+	}
+}
+
+/*	Dispatch events to the count handlers in t forever, each runs once at
+ *	the start
+ */
+void dispatchLoop (const dispatchEntry * const t, const uint8_t count) {
+	assert (count <= DISPATCH_MAX);
+	table = t;
+	entries = count;
+	requests = (uint8_t) ((1 << count)-1);
+
+	while (1) {
+		/* a single load, sources posted later are seen by the next pass */
+		const uint8_t events = wakeup;
+		const uint8_t requested = requests;
+		requests = 0;
+		for (uint8_t i = 0; i < count; i++) {
+			if ((t[i].events & events) || ((requested >> i) & 0x1)) {
+				t[i].handler ();
+			}
+		}
+		if (requests == 0) {
+			powerSleep ();
+		}
+	}
+}
@@ -29,26 +29,111 @@ THE SOFTWARE.
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/sleep.h>
+#include <avr/pgmspace.h>
 
 #include "i2c.h"
 #include "gyro.h"
+#include "timer.h"
+#include "power.h"
+#include "clock.h"
+#include "battery.h"
+#include "dispatch.h"
 
 /* device address */
 #define L3GD20 0b11010100
 /* registers */
 #define L3GD20_WHOAMI 0xf
 #define L3GD20_CTRLREG1 0x20
+#define L3GD20_CTRLREG2 0x21
 #define L3GD20_CTRLREG3 0x22
 #define L3GD20_CTRLREG4 0x23
 #define L3GD20_CTRLREG5 0x24
+#define L3GD20_OUTX 0x28
 #define L3GD20_OUTZ 0x2c
+#define L3GD20_FIFOCTRL 0x2e
+#define L3GD20_INT1CFG 0x30
+#define L3GD20_INT1THSXH 0x32
 
+/* bit positions in registers, see chip docs */
+#define ZHIE 5
+
+/* fifo watermark, samples read per wakeup */
+#define WATERMARK 10
+/* fifo mode bits */
+#define FIFO_BYPASS (0b000 << 5)
+#define FIFO_STREAM (0b010 << 5)
+#define FIFO_BYPASS_TO_STREAM (0b100 << 5)
+/* z rotation above this value (after bias correction) is movement; also used
+ * by the sensor’s interrupt generator to start filling the fifo */
+#define ROTATION_THRESHOLD 64
+/* a batch is considered still if its samples differ by less than this, used
+ * for zero-rate bias estimation */
+#define BIAS_SPREAD 16
+/* bias filter coefficient, 1/8 */
+#define BIAS_SHIFT 3
+
+/* ctrl_reg1 bits */
+#define CTRL1_PD (1 << 3)
+#define CTRL1_ZEN (1 << 2)
+/* output data rate and bandwidth, 95 Hz/12.5 Hz cutoff while waiting for
+ * rotation, 190 Hz/25 Hz cutoff while rotating */
+#define RATE_LOW (0b0000 << 4)
+#define RATE_HIGH (0b0101 << 4)
+#define RATE_MASK (0b1111 << 4)
+/* output data rates (Hz) */
+#define ODR_LOW 95
+#define ODR_HIGH 190
+/* nominal duration of one batch, in timer ticks */
+#define BATCH_TICKS(odr) ((uint16_t) ((uint32_t) WATERMARK*1000000/(odr)/TIMER_US_PER_TICK))
+/* one ztick is 8192 counts for 1/95 s (~6° at 2000 dps), in counts*timer
+ * ticks */
+#define ZTICK ((int32_t) ((uint64_t) 8192*1000000/ODR_LOW/TIMER_US_PER_TICK))
+
+/* fifo contents, x, y, z for each sample; x/y are disabled, but still
+ * stored */
+static int16_t fifo[WATERMARK][3];
 /* raw z value */
-static volatile int16_t zval = 0;
-/* accumulated z value */
+static int16_t zval = 0;
+/* accumulated z rotation, in counts*timer ticks */
 static int32_t zaccum = 0;
+/* zero-rate level, sum of one batch (i.e. counts*WATERMARK) */
+static int32_t bias = 0;
+static bool biasValid = false;
+/* time of the last watermark interrupt, of the batch being read and of the
+ * previous batch; the latter is invalid if batches are not consecutive */
+static volatile uint16_t stamp;
+static uint16_t readStamp, lastStamp;
+static bool stampValid = false;
+/* watermark interrupt line level at the last pin change */
+static volatile bool watermark = false;
 /* calculated zticks */
 static int16_t zticks = 0;
+/* shadow copy of registers 0x20..0x3f, changing rate or power mode is a
+ * single write */
+static uint8_t regs[TW_SHADOW_MAX];
+#define reg(x) regs[(x)-L3GD20_CTRLREG1]
+#define ctrl1 reg(L3GD20_CTRLREG1)
+/* bypass mode, empties the fifo */
+static uint8_t fifoBypass = FIFO_BYPASS;
+
+/* register configuration, see twScript */
+static const uint8_t startScript[] PROGMEM = {
+	/* disable power-down-mode, enable z
+	 * high-pass filter cutoff 0.009 Hz (at 95 Hz odr)
+	 * high-active, push-pull, int1 generator, fifo watermark on int2
+	 * select 2000dps
+	 * enable fifo, high-pass filter for interrupt generator only
+	 */
+	L3GD20_CTRLREG1, 5, RATE_LOW | CTRL1_PD | CTRL1_ZEN, 0b00001001,
+			0b10000100, 0b00110000, 0b01010100,
+	/* interrupt generator on z high event; int1 itself is not connected, but
+	 * the event triggers bypass-to-stream mode */
+	L3GD20_INT1CFG, 1, 1 << ZHIE,
+	/* thresholds x, y, z (high, low), duration */
+	L3GD20_INT1THSXH, 7, 0, 0, 0, 0, ROTATION_THRESHOLD >> 8,
+			ROTATION_THRESHOLD & 0xff, 0,
+	TW_SCRIPT_END,
+};
 
 #define STOPPED 0
 #define START_REQUEST 1
@@ -56,19 +141,32 @@ static int16_t zticks = 0;
 #define STOPPING 4
 #define READING 5
 #define IDLE 6
+#define ARM_REQUEST 7
+#define ARMING 8
 static uint8_t state = STOPPED;
+/* holding a timer1 reference while running */
+static bool timer1Held = false;
 static bool shouldStop = false;
+static gyroStopMode stopMode = GYRO_POWERDOWN;
+/* registers are kept in sleep/power-down, configure only once */
+static bool configured = false;
+/* last i2c request failed */
+static volatile bool i2cFailed = false;
 
-/* data ready interrupt
+/* fifo watermark interrupt, blocking: edge detection and stamp must not be
+ * interleaved with another pin change
  */
 ISR(PCINT0_vect) {
 	const bool interrupt = (PINB >> PINB1) & 0x1;
-	/* high-active */
-	if (interrupt) {
+	/* high-active, the rising edge is a new batch; falling means the
+	 * fifo was drained or reset */
+	if (interrupt && !watermark) {
+		stamp = timerNow ();
 		enableWakeup (WAKE_GYRO);
-	} else {
+	} else if (!interrupt) {
 		disableWakeup (WAKE_GYRO);
 	}
+	watermark = interrupt;
 }
 
 void gyroInit () {
@@ -76,101 +174,328 @@ void gyroInit () {
 	DDRB = DDRB & ~((1 << DDB1));
 	/* enable interrupt PCI0 */
 	PCICR = PCICR | (1 << PCIE0);
-	/* enable interrupts on PB1/PCINT1 */
-	PCMSK0 = (1 << PCINT1);
+	/* PB1/PCINT1 is unmasked while running, see gyroWatch */
+	PCMSK0 = 0;
+}
+
+/*	Watch the watermark line while running. A stopped gyro must not post
+ *	WAKE_GYRO, nobody would consume it and the cpu would never sleep.
+ */
+static void gyroWatch (const bool enable) {
+	ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+		if (enable) {
+			watermark = (PINB >> PINB1) & 0x1;
+			PCMSK0 |= (1 << PCINT1);
+		} else {
+			PCMSK0 &= ~(1 << PCINT1);
+			disableWakeup (WAKE_GYRO);
+		}
+	}
 }
 
 void gyroStart () {
 	assert (state == STOPPED);
+	/* batches are timestamped, timer1 must keep counting */
+	powerHold (POWER_TIMER1, &timer1Held, true);
 	state = START_REQUEST;
 	shouldStop = false;
+	gyroWatch (true);
+	dispatchRequest (gyroProcess);
 }
 
-void gyroStop () {
+static void gyroStopWrite ();
+
+/*	Stop the gyro. Sleep mode keeps the sensor powered with all axes disabled
+ *	and wakes up fast, use it if gyroStart() is expected soon; power-down
+ *	draws almost nothing, but takes longer to start up. Sleep can be turned
+ *	into power-down by calling this function again.
+ */
+void gyroStop (const gyroStopMode mode) {
 	shouldStop = true;
+	stopMode = mode;
+	/* right away if possible, gyroProcess retries if the queue is full or
+	 * a transfer is running */
+	gyroStopWrite ();
+	dispatchRequest (gyroProcess);
+}
+
+/*	i2c request finished, remember failures of intermediate requests too
+ */
+static void gyroI2cCheck (const twStatus status) {
+	if (status != TWST_OK) {
+		i2cFailed = true;
+	}
+}
+
+static void gyroI2cDone (const twStatus status) {
+	gyroI2cCheck (status);
+	enableWakeup (WAKE_GYRO_I2C);
+}
+
+/*	Get and reset i2c failure state
+ */
+static bool gyroI2cFailed () {
+	const bool ret = i2cFailed;
+	i2cFailed = false;
+	return ret;
+}
+
+/*	Empty the fifo and switch to mode, which is one of the FIFO_* modes
+ */
+static bool gyroFifoReset (const uint8_t mode) {
+	reg (L3GD20_FIFOCTRL) = mode | WATERMARK;
+	return twRequest (TWM_WRITE, L3GD20, L3GD20_FIFOCTRL, &fifoBypass,
+					sizeof (fifoBypass), gyroI2cCheck) &&
+			twRequest (TWM_WRITE, L3GD20, L3GD20_FIFOCTRL,
+					&reg (L3GD20_FIFOCTRL), 1, gyroI2cDone);
+}
+
+/*	Write the shadow copy of ctrl_reg1
+ */
+static bool gyroWriteCtrl1 (const twCallback done) {
+	return twRequest (TWM_WRITE, L3GD20, L3GD20_CTRLREG1, &ctrl1,
+			sizeof (ctrl1), done);
+}
+
+/*	Write the stop mode to ctrl_reg1 if the gyro is idle, or sleeping but
+ *	should be powered down
+ */
+static void gyroStopWrite () {
+	if (!shouldStop) {
+		return;
+	}
+	if (state == IDLE) {
+		/* sleep: keep powered, disable all axes */
+		ctrl1 = stopMode == GYRO_SLEEP ? (RATE_LOW | CTRL1_PD) : 0;
+	} else if (state == STOPPED && stopMode == GYRO_POWERDOWN && ctrl1 != 0) {
+		ctrl1 = 0;
+	} else {
+		return;
+	}
+	if (gyroWriteCtrl1 (gyroI2cDone)) {
+		state = STOPPING;
+		/* batches are not read anymore */
+		gyroWatch (false);
+	}
+}
+
+static void gyroSetRate (const uint8_t rate) {
+	ctrl1 = (ctrl1 & ~RATE_MASK) | rate;
 }
 
 /*	calculate ticks for z rotation
  */
 static void gyroProcessTicks () {
-	const uint8_t shift = 13;
-	const uint32_t max = (1 << shift);
-	const uint32_t mask = ~(max-1);
-
-	if (zaccum > (int32_t) max) {
-		const uint32_t a = abs (zaccum);
-		zticks += a >> shift;
-		/* mask shift bits */
-		zaccum -= a & mask;
-	} else if (zaccum < -((int32_t) max)) {
-		const uint32_t a = abs (zaccum);
-		zticks -= a >> shift;
-		zaccum += a & mask;
+	/* both truncate towards zero, the remainder keeps the sign */
+	zticks += zaccum / ZTICK;
+	zaccum %= ZTICK;
+}
+
+/*	Integrate a batch of samples, returns true if the device is rotating
+ */
+static bool gyroProcessBatch () {
+	/* time covered by this batch, the watermark interrupt fires every
+	 * WATERMARK samples; the nominal rate is used if there is no previous
+	 * batch or batches were lost */
+	const uint16_t nominal = (ctrl1 & RATE_MASK) == RATE_HIGH ?
+			BATCH_TICKS (ODR_HIGH) : BATCH_TICKS (ODR_LOW);
+	uint16_t dt = nominal;
+	if (stampValid) {
+		const uint16_t measured = readStamp - lastStamp;
+		if (measured < 2*BATCH_TICKS (ODR_LOW)) {
+			dt = measured;
+		}
+	}
+	lastStamp = readStamp;
+	stampValid = true;
+
+	const int16_t b = bias/WATERMARK;
+	int32_t sum = 0;
+	int16_t min = INT16_MAX, max = INT16_MIN;
+	bool moving = false;
+	for (uint8_t i = 0; i < WATERMARK; i++) {
+		zval = fifo[i][2];
+		sum += zval;
+		if (zval < min) {
+			min = zval;
+		}
+		if (zval > max) {
+			max = zval;
+		}
+		if (abs (zval - b) > ROTATION_THRESHOLD) {
+			moving = true;
+		}
+	}
+
+	/* the device is still, track zero-rate level. A steady turn has a low
+	 * spread as well, so the first estimate also requires the batch to be
+	 * below ROTATION_THRESHOLD, against a nominal zero until then (bias is
+	 * 0). Otherwise the turn rate would become the bias, every batch at
+	 * rest would look like movement and never correct it. */
+	if (max - min < BIAS_SPREAD && !moving) {
+		if (!biasValid) {
+			bias = sum;
+			biasValid = true;
+		} else {
+			bias += (sum - bias) >> BIAS_SHIFT;
+		}
+	}
+
+	/* rectangle rule, each sample covers dt/WATERMARK */
+	zaccum += (sum - bias) * dt / WATERMARK;
+	gyroProcessTicks ();
+
+	return moving;
+}
+
+/*	Drop to the low rate and reset the fifo to bypass-to-stream mode. It stays
+ *	empty until the sensor’s interrupt generator sees rotation above
+ *	ROTATION_THRESHOLD, thus no watermark interrupts while the device is held
+ *	still.
+ */
+static bool gyroArm () {
+	gyroSetRate (RATE_LOW);
+	/* the next batch starts whenever rotation is detected */
+	stampValid = false;
+	return gyroWriteCtrl1 (gyroI2cCheck) &&
+			gyroFifoReset (FIFO_BYPASS_TO_STREAM);
+}
+
+/*	The fifo may still be above the watermark after a read, no new edge
+ *	follows then; post that batch now
+ */
+static void gyroRepost () {
+	ATOMIC_BLOCK (ATOMIC_FORCEON) {
+		if (watermark && !shouldWakeup (WAKE_GYRO)) {
+			stamp = timerNow ();
+			enableWakeup (WAKE_GYRO);
+		}
 	}
 }
 
-/*	process gyro sensor data, returns true if new data is available
+/*	process gyro sensor data
  */
-bool gyroProcess () {
+void gyroProcess () {
+	const uint8_t prev = state;
 	switch (state) {
+		case STOPPED:
+			/* sleeping, but may have to be powered down now */
+			gyroStopWrite ();
+			break;
+
 		case START_REQUEST: {
-			/* configuration:
-			 * disable power-down-mode, enable z
-			 * defaults
-			 * high-active, push-pull, drdy on int2
-			 * select 2000dps
-			 */
-			static uint8_t data[] = {0b00001100, 0b0, 0b00001000, 0b00110000};
-			if (twRequest (TWM_WRITE, L3GD20, L3GD20_CTRLREG1, data,
-					length (data))) {
+			bool ok;
+			stampValid = false;
+			if (configured) {
+				/* disable power-down/sleep mode, enable z */
+				ctrl1 = RATE_LOW | CTRL1_PD | CTRL1_ZEN;
+				ok = gyroWriteCtrl1 (gyroI2cCheck);
+			} else {
+				ok = twScript (L3GD20, regs, L3GD20_CTRLREG1, startScript,
+						gyroI2cCheck, gyroI2cCheck);
+			}
+			/* stream mode to get one batch, which arms the trigger if the
+			 * device is still */
+			if (ok && gyroFifoReset (FIFO_STREAM)) {
 				state = STARTING;
 			}
 			break;
 		}
 
 		case STARTING:
-			if (shouldWakeup (WAKE_I2C)) {
-				disableWakeup (WAKE_I2C);
-				state = IDLE;
+			if (shouldWakeup (WAKE_GYRO_I2C)) {
+				disableWakeup (WAKE_GYRO_I2C);
+				if (gyroI2cFailed ()) {
+					/* bus was reset, configure again */
+					configured = false;
+					state = START_REQUEST;
+				} else {
+					configured = true;
+					state = IDLE;
+				}
 			}
 			break;
 
 		case STOPPING:
-			if (shouldWakeup (WAKE_I2C)) {
-				disableWakeup (WAKE_I2C);
-				state = STOPPED;
+			if (shouldWakeup (WAKE_GYRO_I2C)) {
+				disableWakeup (WAKE_GYRO_I2C);
+				/* shouldStop is still set, retried below */
+				state = gyroI2cFailed () ? IDLE : STOPPED;
+				if (state == STOPPED) {
+					powerHold (POWER_TIMER1, &timer1Held, false);
+				}
 			}
 			break;
 
 		case READING:
-			if (shouldWakeup (WAKE_I2C)) {
-				disableWakeup (WAKE_I2C);
+			if (shouldWakeup (WAKE_GYRO_I2C)) {
+				disableWakeup (WAKE_GYRO_I2C);
 				state = IDLE;
-				/* the bus might be in use again already */
-				//assert (twr.status == TWST_OK);
-				/* new data transfered, process it */
-				/* poor man's noise filter */
-				if (abs (zval) > 64) {
-					zaccum += zval;
+				if (gyroI2cFailed ()) {
+					/* data is still pending in the device, read again */
+					enableWakeup (WAKE_GYRO);
+					break;
+				}
+				gyroRepost ();
+				/* new data transfered, process the whole batch at the fast
+				 * clock */
+				bool fast = false;
+				clockHold (&fast, true);
+				const bool moving = gyroProcessBatch ();
+				clockHold (&fast, false);
+				if (shouldStop) {
+					/* stays idle, stopped below */
+				} else if (!moving) {
+					/* rotation stopped, let the sensor wait for the next one */
+					state = gyroArm () ? ARMING : ARM_REQUEST;
+				} else {
+					/* rotation in progress, speed up unless the battery is
+					 * low; retried with the next batch if the queue is
+					 * full */
+					const uint8_t rate = batteryGetLevel () == BATTERY_OK ?
+							RATE_HIGH : RATE_LOW;
+					const uint8_t prev = ctrl1 & RATE_MASK;
+					if (prev != rate) {
+						gyroSetRate (rate);
+						if (!gyroWriteCtrl1 (NULL)) {
+							gyroSetRate (prev);
+						}
+					}
 				}
-				gyroProcessTicks ();
-				return true;
 			}
 			break;
 
-		case IDLE:
+		case ARM_REQUEST:
 			if (shouldStop) {
-				/* enable power-down mode */
-				static uint8_t data[] = {0b00000000};
+				/* no point in arming */
+				state = IDLE;
+			} else if (gyroArm ()) {
+				state = ARMING;
+			}
+			break;
 
-				if (twRequest (TWM_WRITE, L3GD20, L3GD20_CTRLREG1, data,
-						length (data))) {
-					state = STOPPING;
-				}
+		case ARMING:
+			if (shouldWakeup (WAKE_GYRO_I2C)) {
+				disableWakeup (WAKE_GYRO_I2C);
+				state = gyroI2cFailed () ? ARM_REQUEST : IDLE;
+			}
+			break;
+
+		case IDLE:
+			if (shouldStop) {
+				gyroStopWrite ();
 			} else if (shouldWakeup (WAKE_GYRO) && twRequest (TWM_READ, L3GD20,
-						L3GD20_OUTZ, (uint8_t *) &zval, sizeof (zval))) {
-				/* new data available in device buffer and bus is free */
-				/* wakeup source is disabled by isr to prevent race condition */
+						L3GD20_OUTX, (uint8_t *) fifo, sizeof (fifo),
+						gyroI2cDone)) {
+				/* watermark reached and request was queued; the address
+				 * pointer wraps from OUT_Z_H to OUT_X_L in fifo mode, so a
+				 * single burst drains the whole batch */
+				/* consumed with the stamp, a new one is posted by the isr
+				 * or gyroRepost */
+				ATOMIC_BLOCK (ATOMIC_FORCEON) {
+					readStamp = stamp;
+					disableWakeup (WAKE_GYRO);
+				}
 				state = READING;
 			}
 
@@ -181,7 +506,10 @@ bool gyroProcess () {
 			break;
 	}
 
-	return false;
+	/* a stop requested while a transfer was running waited for idle */
+	if (state == IDLE && prev != IDLE) {
+		gyroStopWrite ();
+	}
 }
 
 int32_t gyroGetZAccum () {
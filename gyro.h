@@ -27,10 +27,14 @@ THE SOFTWARE.
 #include <stdbool.h>
 #include <stdint.h>
 
+typedef uint8_t gyroStopMode;
+#define GYRO_SLEEP 0
+#define GYRO_POWERDOWN 1
+
 void gyroInit ();
 void gyroStart ();
-void gyroStop ();
-bool gyroProcess ();
+void gyroStop (const gyroStopMode);
+void gyroProcess ();
 void gyroResetAccum ();
 int32_t gyroGetZAccum ();
 int16_t gyroGetZRaw ();
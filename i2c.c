@@ -24,30 +24,258 @@ THE SOFTWARE.
 #include <stdio.h>
 #include <util/twi.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
 #include <stdlib.h>
 
 #include "i2c.h"
 #include "common.h"
+#include "timer.h"
+#include "power.h"
+#include "clock.h"
+
+/* request queue size, must be power-of-two; holds TW_QUEUE_LEN-1 requests */
+#define TW_QUEUE_LEN 8
+/* give up on a request after this many attempts */
+#define TW_RETRIES 4
+/* max duration of a single transaction (ms) */
+#define TW_TIMEOUT 10
+
+/* the timer service is used for timeouts, stop polling and retry backoff;
+ * ms to timer ticks, at least one */
+#define TW_MS(x) ((uint16_t) (TIMER_MS_TICKS (x) > 0 ? TIMER_MS_TICKS (x) : 1))
+
+/* max scl frequency (Hz), both sensors support fast mode */
+#define TW_SCL_MAX 400000
+/* TWBR at each clock speed, see CLOCK_TWBR: 62.5 kHz at 1 MHz, 125 kHz at 2 MHz,
+ * 250 kHz at 4 MHz and 400 kHz at 8 MHz */
+#if CLOCK_TWBR (CLOCK_HZ (CLOCK_SLOW), TW_SCL_MAX) > 255
+#error "scl frequency too low"
+#endif
+static const uint8_t twbr[CLOCK_SPEEDS] = {
+		CLOCK_TWBR (CLOCK_HZ (CLOCK_SLOW), TW_SCL_MAX),
+		CLOCK_TWBR (CLOCK_HZ (CLOCK_FAST), TW_SCL_MAX)};
+/* bus recovery: half scl period (timer ticks), up to nine clock pulses, then
+ * a stop condition in four half periods */
+#define TW_RECOVER_TICKS 1
+#define TW_RECOVER_STOP (2*9)
+#define TW_RECOVER_DONE (TW_RECOVER_STOP+4)
+
+/* engine state */
+#define TW_IDLE 0
+/* waiting for stop condition to finish or retry backoff */
+#define TW_WAIT 1
+#define TW_ACTIVE 2
+/* releasing a stuck bus */
+#define TW_RECOVER 3
+
+/* ring buffer of pending requests, queue[head] is the active one */
+static twReq queue[TW_QUEUE_LEN];
+static volatile uint8_t head = 0, tail = 0;
+static volatile uint8_t state = TW_IDLE;
+/* result of the last interrupt step */
+static volatile twStatus status = TWST_OK;
+/* number of times the stop condition was polled */
+static uint8_t polls = 0;
+/* next bus recovery step */
+static uint8_t recoverStep = 0;
+/* i2c bus status at the time if an error occured */
+static volatile uint8_t error;
+/* interrupt step is running, with interrupts enabled */
+static volatile bool stepping = false;
+/* twi is acquired, fast clock is held */
+static bool held = false, fast = false;
+
+#ifdef TW_PROFILE
+/* number of distinct device/register pairs tracked */
+#define TW_PROFILE_LEN 8
+/* timer ticks are too coarse for a transaction, timer0 runs free as the
+ * profiler clock instead; transactions run at the fast clock, 64 us per
+ * count at 4 MHz, wraps after TW_TIMEOUT */
+#define TW_PROFILE_DIVIDER 256
+#define TW_PROFILE_US (TW_PROFILE_DIVIDER*1000000UL/CLOCK_HZ (CLOCK_FAST))
+#if CLOCK_CS01 (TW_PROFILE_DIVIDER) == 0 || \
+		TW_PROFILE_US*256 <= TW_TIMEOUT*1000UL
+#error "cpu speed not supported"
+#endif
+
+/* transaction statistics for one device/register pair, in profiler counts */
+typedef struct {
+	uint8_t address;
+	uint8_t subaddress;
+	/* completed transactions and failed attempts */
+	uint16_t count;
+	uint16_t errors;
+	/* start to completion */
+	uint8_t min;
+	uint8_t max;
+	uint32_t sum;
+	/* longest gap between two interrupt steps */
+	uint8_t maxStep;
+} twProfile;
+
+static twProfile profile[TW_PROFILE_LEN];
+/* timestamp of the last interrupt step, relative to the start of the active
+ * transaction, and its longest step */
+static uint8_t profileLast, profileStep;
+
+/*	Find or allocate the statistics of the active request, NULL if the table
+ *	is full
+ */
+static twProfile *twProfileGet () {
+	const twReq * const r = &queue[head];
+	twProfile *empty = NULL;
+	/* dumping resets slots in place, a match may come after a free one */
+	for (uint8_t i = 0; i < TW_PROFILE_LEN; i++) {
+		twProfile * const p = &profile[i];
+		if (p->count == 0 && p->errors == 0) {
+			if (empty == NULL) {
+				empty = p;
+			}
+		} else if (p->address == r->address &&
+				p->subaddress == r->subaddress) {
+			return p;
+		}
+	}
+	if (empty != NULL) {
+		empty->address = r->address;
+		empty->subaddress = r->subaddress;
+		empty->min = 0xff;
+	}
+	return empty;
+}
+
+/*	Transaction started
+ */
+static void twProfileStart () {
+	/* the speaker is muted, nothing else uses timer0 */
+	TCCR0A = 0;
+	TCCR0B = CLOCK_CS01 (TW_PROFILE_DIVIDER);
+	TCNT0 = 0;
+	profileLast = 0;
+	profileStep = 0;
+}
+
+/*	Interrupt step
+ */
+static void twProfileStep () {
+	const uint8_t now = TCNT0;
+	const uint8_t step = now - profileLast;
+	if (step > profileStep) {
+		profileStep = step;
+	}
+	profileLast = now;
+}
+
+/*	Active request is done
+ */
+static void twProfileFinish (const twStatus result) {
+	twProfile * const p = twProfileGet ();
+	if (p == NULL || result != TWST_OK) {
+		return;
+	}
+	const uint8_t now = TCNT0;
+	++p->count;
+	p->sum += now;
+	if (now < p->min) {
+		p->min = now;
+	}
+	if (now > p->max) {
+		p->max = now;
+	}
+	if (profileStep > p->maxStep) {
+		p->maxStep = profileStep;
+	}
+}
+
+/*	Active request failed
+ */
+static void twProfileError () {
+	twProfile * const p = twProfileGet ();
+	if (p != NULL) {
+		++p->errors;
+	}
+}
+
+/*	Print transaction statistics (µs) to stdout and reset them
+ */
+void twProfileDump () {
+	printf ("i2c scl %lu Hz\naddr reg n err min avg max step\n",
+			(unsigned long) (CLOCK_HZ (CLOCK_FAST)/(16+2*twbr[CLOCK_FAST])));
+	for (uint8_t i = 0; i < TW_PROFILE_LEN; i++) {
+		twProfile p;
+		ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+			p = profile[i];
+			profile[i].count = 0;
+			profile[i].errors = 0;
+			profile[i].sum = 0;
+			profile[i].min = 0xff;
+			profile[i].max = 0;
+			profile[i].maxStep = 0;
+		}
+		if (p.count == 0 && p.errors == 0) {
+			continue;
+		}
+		const uint32_t avg = p.count > 0 ? p.sum*TW_PROFILE_US/p.count : 0;
+		printf ("%02x %02x %u %u %u %lu %u %u\n", p.address, p.subaddress,
+				p.count, p.errors,
+				(unsigned int) (p.count > 0 ? p.min*TW_PROFILE_US : 0),
+				(unsigned long) avg, (unsigned int) (p.max*TW_PROFILE_US),
+				(unsigned int) (p.maxStep*TW_PROFILE_US));
+	}
+}
+#else
+static void twProfileStart () {
+}
+
+static void twProfileStep () {
+}
+
+static void twProfileFinish (const twStatus result __unused__) {
+}
 
-twReq twr;
+static void twProfileError () {
+}
+#endif
+
+/*	A bus action is about to be started. Within an interrupt step interrupts
+ *	are disabled first: the action may complete and raise the unmasked twi
+ *	interrupt before the step is done, which must not nest.
+ */
+static void twActionRaw () {
+	if (stepping) {
+		cli ();
+	}
+}
 
 static void twStartRaw () {
+	twActionRaw ();
 	/* disable stop, enable interrupt, reset twint, enable start, enable i2c */
 	TWCR = (TWCR & ~(1 << TWSTO)) | (1 << TWIE) | (1 << TWINT) | (1 << TWSTA) | (1 << TWEN);
 }
 
 static void twStopRaw () {
+	twActionRaw ();
 	/* disable start, enable interrupt, reset twint, enable stop, enable i2c */
 	TWCR = (TWCR & ~(1 << TWSTA)) | (1 << TWIE) | (1 << TWINT) | (1 << TWSTO) | (1 << TWEN);
 }
 
+/* stop, immediately followed by start of the next transaction */
+static void twStopStartRaw () {
+	twActionRaw ();
+	/* enable interrupt, reset twint, enable stop and start, enable i2c */
+	TWCR = (TWCR & ~(1 << TWEA)) | (1 << TWIE) | (1 << TWINT) | (1 << TWSTO) | (1 << TWSTA) | (1 << TWEN);
+}
+
 static void twFlushRaw () {
+	twActionRaw ();
 	/* disable start/stop, enable interrupt, reset twint, enable i2c */
 	TWCR = (TWCR & ~((1 << TWSTA) | (1 << TWSTO) | (1 << TWEA))) | (1 << TWIE) | (1 << TWINT) | (1 << TWEN);
 }
 
 /* flush and send master ack */
 static void twFlushContRaw () {
+	twActionRaw ();
 	/* disable start/stop, enable interrupt, reset twint, enable i2c, send master ack */
 	TWCR = (TWCR & ~((1 << TWSTA) | (1 << TWSTO))) | (1 << TWIE) | (1 << TWINT) | (1 << TWEN) | (1 << TWEA);
 }
@@ -59,6 +287,12 @@ static void twWaitRaw () {
 }
 #endif
 
+static void twTimeout ();
+
+static void twTimerStart (const uint16_t ticks) {
+	timerStartTicks (TIMER_I2C, ticks);
+}
+
 static bool twWriteRaw (const uint8_t data) {
 	TWDR = data;
 	if (TWCR & (1 << TWWC)) {
@@ -68,103 +302,369 @@ static bool twWriteRaw (const uint8_t data) {
 	}
 }
 
-void twInit () {
-#if F_CPU == 1000000
-	/* set scl to 50 kHz */
-	TWBR = 2;
-	/* prescaler 1 */
-	TWSR &= ~((1 << TWPS1) | (1 << TWPS0));
-#elif F_CPU == 4000000
-	/* set scl to 50 kHz ? */
-	TWBR = 32;
-	/* prescaler 1 */
-	TWSR &= ~((1 << TWPS1) | (1 << TWPS0));
-#elif F_CPU == 8000000
-	/* set scl to 100 kHz */
-	TWBR = 32;
+/*	Set up bit rate and prescaler, after reset and whenever the twi was
+ *	gated, which loses its registers
+ */
+static void twSetup () {
+	TWBR = twbr[clockCurrent ()];
 	/* prescaler 1 */
 	TWSR &= ~((1 << TWPS1) | (1 << TWPS0));
-#else
-#error "cpu speed not supported"
+	TWCR = 0;
+}
+
+void twInit () {
+	twSetup ();
+
+	head = 0;
+	tail = 0;
+	state = TW_IDLE;
+	status = TWST_OK;
+
+	timerSetCallback (TIMER_I2C, twTimeout);
+#ifdef TW_PROFILE
+	/* profiler clock, never released */
+	powerAcquire (POWER_TIMER0);
 #endif
+}
 
-	twr.mode = TWM_INVALID;
-	twr.status = TWST_OK;
+/*	Cpu clock changed to s, called by the clock manager with interrupts
+ *	disabled
+ */
+void twClock (const clockSpeed s) {
+	if (held) {
+		TWBR = twbr[s];
+	}
 }
 
-/*	high-level write, returns false if bus is busy
+/*	Release a stuck bus: clock out a slave holding sda low, then send stop.
+ *	Runs as timer service steps, see twRecoverStep.
  */
-bool twRequest (const twMode mode, const uint8_t address,
-		const uint8_t subaddress, uint8_t * const data, const uint8_t count) {
-	/* busy */
-	if (twr.status != TWST_OK) {
-		return false;
+static void twRecover () {
+	/* disconnect twi, pins are open-drain now, idle high through pull-ups */
+	TWCR = 0;
+	PORTC &= ~((1 << PORTC4) | (1 << PORTC5));
+	DDRC &= ~((1 << DDC4) | (1 << DDC5));
+	state = TW_RECOVER;
+	recoverStep = 0;
+	twTimerStart (TW_RECOVER_TICKS);
+}
+
+static void twRecovered ();
+
+/*	One half scl period of the bus recovery, called from the timer interrupt
+ */
+static void twRecoverStep () {
+	uint8_t s = recoverStep;
+	if (s == TW_RECOVER_DONE) {
+		twRecovered ();
+		return;
+	}
+	if (s < TW_RECOVER_STOP && !(s & 1) && (PINC & (1 << PINC4))) {
+		/* sda is free, no more clock pulses needed */
+		s = TW_RECOVER_STOP;
+	}
+	if (s < TW_RECOVER_STOP) {
+		/* clock pulse, scl low first */
+		if (s & 1) {
+			DDRC &= ~(1 << DDC5);
+		} else {
+			DDRC |= (1 << DDC5);
+		}
+	} else {
+		/* stop: pull sda low while scl is low, then release scl first */
+		switch (s - TW_RECOVER_STOP) {
+			case 0:
+				DDRC |= (1 << DDC5);
+				break;
+
+			case 1:
+				DDRC |= (1 << DDC4);
+				break;
+
+			case 2:
+				DDRC &= ~(1 << DDC5);
+				break;
+
+			default:
+				DDRC &= ~(1 << DDC4);
+				break;
+		}
+	}
+	recoverStep = s+1;
+	twTimerStart (TW_RECOVER_TICKS);
+}
+
+static void twError ();
+
+/*	Start the active request, delayed if the previous stop is still pending.
+ *	Interrupts must be disabled.
+ */
+static void twStart () {
+	/* transfers run at the fast clock */
+	clockHold (&fast, true);
+	if (!held) {
+		/* the twi ignores writes while gated and must be reinitialized */
+		powerHold (POWER_TWI, &held, true);
+		twSetup ();
+	}
+	twReq * const r = &queue[head];
+	r->step = 0;
+	r->i = 0;
+	status = TWST_WAIT;
+	/* there is no interrupt for stop completion, poll with the timer */
+	if (TW_STATUS != TW_NO_INFO || TWCR & (1 << TWSTO)) {
+		++polls;
+		if (polls > TW_MS (TW_TIMEOUT)) {
+			polls = 0;
+			twError ();
+		} else {
+			state = TW_WAIT;
+			twTimerStart (1);
+		}
+	} else {
+		polls = 0;
+		state = TW_ACTIVE;
+		twTimerStart (TW_MS (TW_TIMEOUT));
+		twProfileStart ();
+		twStartRaw ();
 	}
+}
 
+/*	Queue a request, returns false if the queue is full. done is called from
+ *	interrupt context once the request is finished. data must stay valid until
+ *	then.
+ */
+bool twRequest (const twMode mode, const uint8_t address,
+		const uint8_t subaddress, uint8_t * const data, const uint8_t count,
+		const twCallback done) {
 	assert (count > 0);
 	assert (data != NULL);
 
-	twr.mode = mode;
-	twr.address = address;
-	twr.subaddress = subaddress;
-	twr.data = data;
-	twr.count = count;
-	twr.i = 0;
-	twr.step = 0;
-	twr.status = TWST_WAIT;
-	/* wait for stop finish; there is no interrupt generated for this */
-	while (TW_STATUS != 0xf8 || TWCR & (1 << TWSTO));
-	twStartRaw ();
+	bool ret = false;
+	/* may be called from a completion callback, i.e. with interrupts off */
+	ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+		const uint8_t next = (tail+1) & (TW_QUEUE_LEN-1);
+		if (next != head) {
+			twReq * const r = &queue[tail];
+			r->mode = mode;
+			r->address = address;
+			r->subaddress = subaddress;
+			r->data = data;
+			r->count = count;
+			r->i = 0;
+			r->step = 0;
+			r->done = done;
+			r->retries = 0;
+			tail = next;
+
+			if (state == TW_IDLE) {
+				twStart ();
+			}
+			ret = true;
+		}
+	}
+
+	return ret;
+}
+
+/*	Number of requests that can be queued
+ */
+static uint8_t twFree () {
+	return (head - tail - 1) & (TW_QUEUE_LEN-1);
+}
+
+/*	Run a register script for device address. script lives in program memory
+ *	and consists of entries (first register, number of registers, values...),
+ *	terminated by TW_SCRIPT_END. Values are copied to shadow, which mirrors
+ *	the device’s registers starting at base. Afterwards every run of
+ *	contiguous registers touched by the script is written using a single
+ *	auto-increment request, in ascending order. check is called for every
+ *	but the last request, done for the last one.
+ *
+ *	Returns false and queues nothing if the queue is too full.
+ */
+bool twScript (const uint8_t address, uint8_t * const shadow,
+		const uint8_t base, const uint8_t *script, const twCallback check,
+		const twCallback done) {
+	uint32_t dirty = 0;
+	while (true) {
+		const uint8_t reg = pgm_read_byte (script++);
+		const uint8_t count = pgm_read_byte (script++);
+		if (count == 0) {
+			break;
+		}
+		for (uint8_t i = 0; i < count; i++) {
+			const uint8_t offset = reg - base + i;
+			assert (offset < TW_SHADOW_MAX);
+			shadow[offset] = pgm_read_byte (script++);
+			dirty |= (uint32_t) 1 << offset;
+		}
+	}
+	assert (dirty != 0);
+
+	/* one request for each run of set bits */
+	uint8_t runs = 0;
+	for (uint32_t d = dirty & ~(dirty << 1); d != 0; d >>= 1) {
+		runs += d & 0x1;
+	}
+
+	bool ret = false;
+	ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+		if (twFree () >= runs) {
+			uint8_t offset = 0;
+			while (dirty != 0) {
+				while (!(dirty & 0x1)) {
+					dirty >>= 1;
+					++offset;
+				}
+				uint8_t count = 0;
+				while (dirty & 0x1) {
+					dirty >>= 1;
+					++count;
+				}
+				twRequest (TWM_WRITE, address, base + offset, &shadow[offset],
+						count, dirty == 0 ? done : check);
+				offset += count;
+			}
+			ret = true;
+		}
+	}
+
+	return ret;
+}
+
+/*	Active request is done, notify its owner and chain into the next one
+ */
+static void twFinish (const twStatus result) {
+	twProfileFinish (result);
+	const twCallback done = queue[head].done;
+	head = (head+1) & (TW_QUEUE_LEN-1);
+
+	/* callback may queue another request */
+	if (done != NULL) {
+		done (result);
+	}
+
+	if (head != tail) {
+		if (result == TWST_OK) {
+			twReq * const r = &queue[head];
+			r->step = 0;
+			r->i = 0;
+			status = TWST_WAIT;
+			twTimerStart (TW_MS (TW_TIMEOUT));
+			twProfileStart ();
+			twStopStartRaw ();
+		} else {
+			/* bus was reset, no stop required */
+			twStart ();
+		}
+	} else {
+		if (result == TWST_OK) {
+			twStopRaw ();
+		}
+		state = TW_IDLE;
+		/* release the twi once the stop condition is sent */
+		twTimerStart (1);
+	}
+}
+
+/*	Bus is idle, gate the twi unless the stop condition is still pending
+ */
+static void twRelease () {
+	if (TWCR & (1 << TWSTO)) {
+		++polls;
+		if (polls > TW_MS (TW_TIMEOUT)) {
+			polls = 0;
+			/* releases the twi when done */
+			twRecover ();
+		} else {
+			twTimerStart (1);
+		}
+	} else {
+		polls = 0;
+		powerHold (POWER_TWI, &held, false);
+		clockHold (&fast, false);
+	}
+}
 
-	return true;
+/*	Active request failed, reset the bus and retry with exponential backoff
+ */
+static void twError () {
+	twReq * const r = &queue[head];
+	twProfileError ();
+	++r->retries;
+	twRecover ();
+}
+
+/*	Bus recovery is done. Retry the active request after a backoff or give
+ *	up on it, start a request queued in the meantime or release the twi.
+ */
+static void twRecovered () {
+	TWCR = (1 << TWEN);
+	if (head == tail) {
+		state = TW_IDLE;
+		twRelease ();
+		return;
+	}
+	twReq * const r = &queue[head];
+	if (r->retries == 0) {
+		/* queued while recovering an idle bus */
+		twStart ();
+	} else if (r->retries < TW_RETRIES) {
+		state = TW_WAIT;
+		twTimerStart (TW_MS (1) << r->retries);
+	} else {
+		twFinish (TWST_ERR);
+	}
 }
 
 /*	handle interrupt, write request
  */
-static void twIntWrite () {
-	switch (twr.step) {
+static void twIntWrite (twReq * const r) {
+	switch (r->step) {
 		case 0:
 			if (TW_STATUS == TW_START) {
-				twWriteRaw (twr.address | TW_WRITE);
+				twWriteRaw (r->address | TW_WRITE);
 				twFlushRaw ();
-				++twr.step;
+				++r->step;
 			} else {
-				twr.status = TWST_ERR;
+				status = TWST_ERR;
+				error = TW_STATUS;
 			}
 			break;
 
 		case 1:
 			if (TW_STATUS == TW_MT_SLA_ACK) {
 				/* write subaddress, enable auto-increment */
-				twWriteRaw ((1 << 7) | twr.subaddress);
+				twWriteRaw ((1 << 7) | r->subaddress);
 				twFlushRaw ();
-				++twr.step;
+				++r->step;
 			} else {
-				twr.status = TWST_ERR;
+				status = TWST_ERR;
+				error = TW_STATUS;
 			}
 			break;
 
 		case 2:
 			if (TW_STATUS == TW_MT_DATA_ACK) {
-				twWriteRaw (twr.data[twr.i]);
-				++twr.i;
+				twWriteRaw (r->data[r->i]);
+				++r->i;
 				twFlushRaw ();
-				if (twr.i >= twr.count) {
-					++twr.step;
+				if (r->i >= r->count) {
+					++r->step;
 				}
 			} else {
-				twr.status = TWST_ERR;
+				status = TWST_ERR;
+				error = TW_STATUS;
 			}
 			break;
 
 		case 3:
 			if (TW_STATUS == TW_MT_DATA_ACK) {
-				twStopRaw ();
-				twr.status = TWST_OK;
-				enableWakeup (WAKE_I2C);
-				++twr.step;
+				twFinish (TWST_OK);
 			} else {
-				twr.status = TWST_ERR;
+				status = TWST_ERR;
+				error = TW_STATUS;
 			}
 			break;
 
@@ -176,95 +676,101 @@ static void twIntWrite () {
 
 /*	handle interrupt, read request
  */
-static void twIntRead () {
-	uint8_t status = TW_STATUS;
-	switch (twr.step) {
+static void twIntRead (twReq * const r) {
+	const uint8_t s = TW_STATUS;
+	switch (r->step) {
 		case 0:
-			if (status == TW_START) {
+			if (s == TW_START) {
 				/* write device address */
-				twWriteRaw (twr.address | TW_WRITE);
+				twWriteRaw (r->address | TW_WRITE);
 				twFlushRaw ();
-				++twr.step;
+				++r->step;
 			} else {
-				twr.status = TWST_ERR;
-				twr.error = status;
+				status = TWST_ERR;
+				error = s;
 			}
 			break;
 
 		case 1:
-			if (status == TW_MT_SLA_ACK) {
+			if (s == TW_MT_SLA_ACK) {
 				/* write subaddress, enable auto-increment */
-				twWriteRaw ((1 << 7) | twr.subaddress);
+				twWriteRaw ((1 << 7) | r->subaddress);
 				twFlushRaw ();
-				++twr.step;
+				++r->step;
 			} else {
-				twr.status = TWST_ERR;
-				twr.error = status;
+				status = TWST_ERR;
+				error = s;
 			}
 			break;
 
 		case 2:
-			if (status == TW_MT_DATA_ACK) {
+			if (s == TW_MT_DATA_ACK) {
 				/* send repeated start */
 				twStartRaw ();
-				++twr.step;
+				++r->step;
 			} else {
-				twr.status = TWST_ERR;
-				twr.error = status;
+				status = TWST_ERR;
+				error = s;
 			}
 			break;
 
 		case 3:
-			if (status == TW_REP_START) {
+			if (s == TW_REP_START) {
 				/* now start the actual read request */
-				twWriteRaw (twr.address | TW_READ);
+				twWriteRaw (r->address | TW_READ);
 				twFlushRaw ();
-				++twr.step;
+				++r->step;
 			} else {
-				twr.status = TWST_ERR;
-				twr.error = status;
+				status = TWST_ERR;
+				error = s;
 			}
 			break;
 
 		case 4:
-			if (status == TW_MR_SLA_ACK) {
-				/* send master ack if next data block is received */
-				twFlushContRaw ();
-				++twr.step;
+			if (s == TW_MR_SLA_ACK) {
+				if (r->count > 1) {
+					/* send master ack if next data block is received */
+					twFlushContRaw ();
+					++r->step;
+				} else {
+					/* only one byte, nack it */
+					twFlushRaw ();
+					r->step += 2;
+				}
 			} else {
-				twr.status = TWST_ERR;
-				twr.error = status;
+				status = TWST_ERR;
+				error = s;
 			}
 			break;
 
 		case 5:
-			if (status == TW_MR_DATA_ACK) {
-				twr.data[twr.i] = TWDR;
-				++twr.i;
-				if (twr.i < twr.count) {
+			if (s == TW_MR_DATA_ACK) {
+				r->data[r->i] = TWDR;
+				++r->i;
+				if (r->i < r->count-1) {
 					/* read another byte, not the last one */
 					twFlushContRaw ();
 					/* step stays the same */
 				} else {
 					/* read last byte, send master nack */
 					twFlushRaw ();
-					++twr.step;
+					++r->step;
 				}
 			} else {
-				twr.status = TWST_ERR;
-				twr.error = status;
+				status = TWST_ERR;
+				error = s;
 			}
 			break;
 
 		case 6:
-			if (status == TW_MR_DATA_NACK) {
-				twStopRaw ();
-				twr.status = TWST_OK;
-				enableWakeup (WAKE_I2C);
-				++twr.step;
+			if (s == TW_MR_DATA_NACK) {
+				/* nack’d bytes are valid too, do not read past the end */
+				r->data[r->i] = TWDR;
+				++r->i;
+				twFinish (TWST_OK);
 			} else {
-				twr.status = TWST_ERR;
-				twr.error = status;
+				status = TWST_ERR;
+				error = s;
 			}
 			break;
 
@@ -274,20 +780,78 @@ static void twIntRead () {
 	}
 }
 
+/*	Interrupt step. twint stays set until the next bus action is started, so
+ *	the twi interrupt is masked instead and interrupts are enabled, which
+ *	keeps the pwm interrupt latency bounded. Starting the next action
+ *	unmasks it again and finishes the step with interrupts disabled.
+ */
 ISR(TWI_vect) {
-	switch (twr.mode) {
+	/* writing twint would start the next action */
+	TWCR = TWCR & ~((1 << TWIE) | (1 << TWINT));
+	stepping = true;
+	sei ();
+
+	twReq * const r = &queue[head];
+	twProfileStep ();
+	switch (r->mode) {
 		case TWM_WRITE:
-			twIntWrite ();
+			twIntWrite (r);
 			break;
 
 		case TWM_READ:
-			twIntRead ();
+			twIntRead (r);
 			break;
 
 		default:
 			assert (0 && "nope\n");
 			break;
 	}
-	assert (twr.status != TWST_ERR);
+
+	if (status == TWST_ERR) {
+		twError ();
+	}
+
+	cli ();
+	stepping = false;
+}
+
+/*	Timeout, stop polling and backoff; timer service callback
+ */
+static void twTimeout () {
+	if (stepping) {
+		/* interrupted a step, which may finish the transaction; check again
+		 * afterwards */
+		twTimerStart (1);
+		return;
+	}
+
+	switch (state) {
+		case TW_WAIT:
+			twStart ();
+			break;
+
+		case TW_ACTIVE:
+			/* the twi interrupt may finish the transaction after the timer
+			 * fired and start the next one, which restarts the timer */
+			ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+				if (state == TW_ACTIVE && !timerRunning (TIMER_I2C)) {
+					/* transaction did not finish in time */
+					error = TW_STATUS;
+					twError ();
+				}
+			}
+			break;
+
+		case TW_IDLE:
+			twRelease ();
+			break;
+
+		case TW_RECOVER:
+			twRecoverStep ();
+			break;
+
+		default:
+			break;
+	}
 }
 
@@ -36,30 +36,50 @@ typedef uint8_t twStatus;
 #define TWST_OK 1
 #define TWST_ERR 2
 
+typedef void (*twCallback) (const twStatus);
+
 #include <stdint.h>
 
 typedef struct {
 	twMode mode;
 	uint8_t address;
 	uint8_t subaddress;
-	volatile uint8_t step;
+	uint8_t step;
 	/* pointer to read/write data */
 	volatile uint8_t *data;
 	/* number of bytes to be read/written */
 	uint8_t count;
 	/* current byte */
-	volatile uint8_t i;
-	volatile twStatus status;
-	/* i2c bus status at the time if an error occured */
-	volatile uint8_t error;
+	uint8_t i;
+	/* failed attempts */
+	uint8_t retries;
+	/* called from interrupt context when the request is done, may be NULL */
+	twCallback done;
 } twReq;
 
-extern twReq twr;
-
 #include <stdbool.h>
 
+#include "clock.h"
+
+/* register script terminator */
+#define TW_SCRIPT_END 0, 0
+/* max number of registers mirrored by a shadow copy */
+#define TW_SHADOW_MAX 32
+
+/* define TW_PROFILE (i.e. make CFLAGS+=-DTW_PROFILE) to collect transaction
+ * timing statistics, see twProfileDump; uses timer0, which mutes the speaker
+ * and keeps the cpu from powering down */
+
 void twInit ();
+void twClock (const clockSpeed);
 bool twRequest (const twMode mode, const uint8_t address,
-		const uint8_t subaddress, uint8_t * const data, const uint8_t count);
+		const uint8_t subaddress, uint8_t * const data, const uint8_t count,
+		const twCallback done);
+bool twScript (const uint8_t address, uint8_t * const shadow,
+		const uint8_t base, const uint8_t *script, const twCallback check,
+		const twCallback done);
+#ifdef TW_PROFILE
+void twProfileDump ();
+#endif
 
 #endif /* TW_H */
@@ -0,0 +1,168 @@
+/*
+Copyright (c) 2014-2015
+	Lars-Dominik Braun <lars@6xq.net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/*	Power manager
+ *
+ *	Drivers acquire the peripherals they need and release them when done,
+ *	unused ones are gated in PRR. Before sleeping the deepest mode
+ *	compatible with the held peripherals is chosen: anything but the timer
+ *	service’s timer1 reference needs the i/o clock, i.e. idle mode.
+ *	Otherwise the cpu is powered down, if the timer service can keep time
+ *	with the watchdog. Power-save and standby are not used: timer2 has no
+ *	32 kHz crystal to run from and the internal oscillator does not benefit
+ *	from standby.
+ */
+
+#include "common.h"
+
+#include <avr/io.h>
+#include <stdio.h>
+#include <string.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
+
+#include "power.h"
+#include "timer.h"
+
+/* PRR bit of each resource */
+static const uint8_t prrbits[POWER_RESOURCES] = {PRTWI, PRTIM2, PRTIM0,
+		PRTIM1, PRSPI, PRUSART0, PRADC};
+/* reference count of each resource */
+static uint8_t refs[POWER_RESOURCES];
+
+#ifdef POWER_PROFILE
+/* sleeps per mode, sleeps kept shallow by each resource and by the timer
+ * service */
+static uint16_t residency[POWER_MODES];
+static uint16_t blocked[POWER_RESOURCES+1];
+#define powerCount(x) ++(x)
+#else
+#define powerCount(x)
+#endif
+
+/*	Gate everything nobody acquired during initialization, must be called
+ *	after all drivers are set up, since gated peripherals ignore writes
+ */
+void powerInit () {
+	/* the analog comparator is never used */
+	ACSR = (1 << ACD);
+	uint8_t prr = 0;
+	for (uint8_t i = 0; i < POWER_RESOURCES; i++) {
+		if (refs[i] == 0) {
+			prr |= 1 << prrbits[i];
+		}
+	}
+	PRR = prr;
+}
+
+/*	Ungate resource r. Its registers do not keep their state while it is
+ *	gated, the owner must set it up again after acquiring it.
+ */
+void powerAcquire (const powerResource r) {
+	assert (r < POWER_RESOURCES);
+	ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+		assert (refs[r] < UINT8_MAX);
+		if (refs[r]++ == 0) {
+			PRR &= ~(1 << prrbits[r]);
+		}
+	}
+}
+
+/*	Drop a reference to r, gate it if it was the last one. The peripheral
+ *	must be stopped.
+ */
+void powerRelease (const powerResource r) {
+	assert (r < POWER_RESOURCES);
+	ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+		assert (refs[r] > 0);
+		if (--refs[r] == 0) {
+			PRR |= 1 << prrbits[r];
+		}
+	}
+}
+
+/*	Acquire or release r, depending on need, if held does not match. For
+ *	drivers that hold one reference at most.
+ */
+void powerHold (const powerResource r, bool * const held, const bool need) {
+	ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+		if (need && !*held) {
+			powerAcquire (r);
+			*held = true;
+		} else if (!need && *held) {
+			*held = false;
+			powerRelease (r);
+		}
+	}
+}
+
+/*	Sleep until a wakeup is posted, in the deepest mode possible
+ */
+void powerSleep () {
+	while (true) {
+		cli ();
+		if (wakeup != 0) {
+			sei ();
+			break;
+		}
+
+		bool shallow = false;
+		for (uint8_t i = 0; i < POWER_RESOURCES; i++) {
+			if (refs[i] > (i == POWER_TIMER1 ? 1 : 0)) {
+				shallow = true;
+				powerCount (blocked[i]);
+			}
+		}
+		/* must be last, marks the watchdog period as slept */
+		if (!shallow && !timerPowerDown ()) {
+			shallow = true;
+			powerCount (blocked[POWER_RESOURCES]);
+		}
+		powerCount (residency[shallow ? POWER_IDLE : POWER_DOWN]);
+
+		set_sleep_mode (shallow ? SLEEP_MODE_IDLE : SLEEP_MODE_PWR_DOWN);
+		sleep_enable ();
+		/* the instruction following sei is executed before any interrupt */
+		sei ();
+		sleep_cpu ();
+		sleep_disable ();
+		cli ();
+		timerWake ();
+	}
+}
+
+#ifdef POWER_PROFILE
+void powerDump () {
+	uint16_t r[POWER_MODES], b[POWER_RESOURCES+1];
+	ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+		memcpy (r, residency, sizeof (r));
+		memcpy (b, blocked, sizeof (b));
+		memset (residency, 0, sizeof (residency));
+		memset (blocked, 0, sizeof (blocked));
+	}
+	printf ("sleep idle %u down %u\nshallow twi %u t2 %u t0 %u t1 %u spi %u "
+			"usart %u adc %u timer %u\n", r[POWER_IDLE], r[POWER_DOWN],
+			b[POWER_TWI], b[POWER_TIMER2], b[POWER_TIMER0], b[POWER_TIMER1],
+			b[POWER_SPI], b[POWER_USART], b[POWER_ADC], b[POWER_RESOURCES]);
+}
+#endif
@@ -0,0 +1,61 @@
+/*
+Copyright (c) 2014-2015
+	Lars-Dominik Braun <lars@6xq.net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef POWER_H
+#define POWER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* peripherals with a power reduction bit, gated while nobody holds them */
+typedef uint8_t powerResource;
+#define POWER_TWI 0
+#define POWER_TIMER2 1
+#define POWER_TIMER0 2
+/* the timer service holds one reference and keeps time in power-down with
+ * the watchdog, further holders need timer1 to count */
+#define POWER_TIMER1 3
+#define POWER_SPI 4
+#define POWER_USART 5
+#define POWER_ADC 6
+#define POWER_RESOURCES 7
+
+/* sleep modes chosen by powerSleep */
+typedef uint8_t powerMode;
+#define POWER_IDLE 0
+#define POWER_DOWN 1
+#define POWER_MODES 2
+
+void powerInit ();
+void powerAcquire (const powerResource);
+void powerRelease (const powerResource);
+void powerHold (const powerResource, bool * const, const bool);
+void powerSleep ();
+
+/* define POWER_PROFILE (i.e. make CFLAGS+=-DPOWER_PROFILE) to count sleeps
+ * per mode and what prevented power-down, see powerDump */
+#ifdef POWER_PROFILE
+void powerDump ();
+#endif
+
+#endif /* POWER_H */
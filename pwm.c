@@ -21,7 +21,30 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
-/*	LED pwm, uses timer0
+/*	LED pwm, uses timer2
+ *
+ *	Binary code modulation: brightness bit p of every LED is shown for 2^p
+ *	time units. A frame takes PWM_SEGMENTS interrupts instead of one per
+ *	brightness level.
+ *
+ *	With PWM_STAGGER bit 5 is shown in two halves, one per half frame, and
+ *	odd LEDs show bits 0..4 where even ones show bit 5 and the other way
+ *	round, see pwmlayout.h. The frame has 11 segments. Every LED keeps its
+ *	duty, so the brightness is unchanged, but the peak current of LEDs at
+ *	the same level below bit 5 drops by half.
+ *
+ *	The compare interrupt runs once per segment, which makes it the hottest
+ *	code in the firmware. With PWM_ASM it is a naked assembler handler,
+ *	see below.
+ *
+ *	Keyframe sequences are advanced by the interrupt at the start of each
+ *	frame. Cross-fades change one level at a time, stepped by the timer
+ *	service, and the frames in between are static. Both post WAKE_ANIMATION
+ *	when done.
+ *
+ *	pwmSet/pwmSetOff draw into a back buffer, pwmCommit makes the interrupt
+ *	swap it with the front buffer at the next frame boundary, so a redraw is
+ *	never shown half-done. Animations change the front buffer directly.
  */
 
 #include "common.h"
@@ -31,65 +54,392 @@ THE SOFTWARE.
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <util/atomic.h>
+#include <avr/pgmspace.h>
 
 #include "pwm.h"
+#include "power.h"
+#include "clock.h"
+#include "timer.h"
+
+/* hand-written compare interrupt, comment out for the C version */
+#define PWM_ASM
+
+/* one time unit is 128 us, a frame 63 units (~8 ms, 124 Hz); timer2 counts
+ * 128 us/UNIT at both clock speeds, i.e. its divider is scaled along with the
+ * cpu clock */
+#define UNIT (CLOCK_RC/CLOCK_HZ (CLOCK_FAST))
+#define DIVIDER_FAST (CLOCK_HZ (CLOCK_FAST)/1000000*128/UNIT)
+#if CLOCK_CS2 (DIVIDER_FAST) == 0 || CLOCK_CS2 (DIVIDER_FAST/CLOCK_SCALE) == 0
+#error "cpu speed not supported"
+#endif
+static const uint8_t prescalers[CLOCK_SPEEDS] = {
+		CLOCK_CS2 (DIVIDER_FAST/CLOCK_SCALE), CLOCK_CS2 (DIVIDER_FAST)};
+/* fast pwm with top OCR2A: unlike ctc, OCR2A is double buffered and loaded
+ * at the end of each period, so the interrupt sets the duration of the next
+ * segment and may start late without missing the compare match. Output
+ * pins are not connected. */
+#define MODE_A ((1 << WGM21) | (1 << WGM20))
+#define MODE_B (1 << WGM22)
+
+/* animation kinds */
+#define ANIM_NONE 0
+#define ANIM_SEQUENCE 1
+#define ANIM_CROSSFADE 2
+
+#ifdef PWM_STAGGER
+#define PWM_SEGMENTS PWM_STAGGER_SEGMENTS
+#else
+#define PWM_SEGMENTS PWM_PLAIN_SEGMENTS
+#endif
 
-/* Slow mode for LEDs only */
-#define SLOW_PRESCALER ((1 << CS02) | (0 << CS01) | (1 << CS00))
-/* Fast mode with speaker */
-#define FAST_PRESCALER ((1 << CS02) | (0 << CS01) | (0 << CS00))
+/* segment: compare value (i.e. duration) of the following segment, port
+ * values, flags. The layout is used by the assembler interrupt. */
+typedef struct {
+	uint8_t ocr;
+	uint8_t ports[2];
+	uint8_t flags;
+} pwmSegment;
 
-static uint8_t count = 0;
-static uint8_t speakerCount = 0;
-static uint8_t pwmvalue[PWM_MAX_BRIGHTNESS][2];
+/* last segment of the frame */
+#define SEGMENT_LAST 0
+
+/* segments and brightness of each LED */
+typedef struct {
+	pwmSegment segments[PWM_SEGMENTS];
+	uint8_t values[PWM_LED_COUNT];
+} pwmFrame;
+
+/* port and bit of a LED, id indexes pwmFrame.values, phase selects the bit
+ * order */
+typedef struct {
+	uint8_t id;
+	uint8_t array;
+	uint8_t bit;
+	uint8_t phase;
+} pwmLed;
+
+#ifdef PWM_ASM
+/* next segment to show, kept in gpior1/gpior2 for the interrupt */
+#define pwmGetSegment() ((pwmSegment *) (uintptr_t) (GPIOR1 | (GPIOR2 << 8)))
+#define pwmSetSegment(s) do { \
+		const uint16_t addr = (uintptr_t) (s); \
+		GPIOR1 = addr & 0xff; \
+		GPIOR2 = addr >> 8; \
+	} while (0)
+#else
+/* next segment to show */
+static uint8_t segment = 0;
+#endif
+/* front buffer is shown, back buffer is drawn into */
+static pwmFrame frames[2];
+static pwmFrame *front = &frames[0], *back = &frames[1];
+/* back buffer was committed, swap at the next frame */
+static volatile bool flip = false;
+/* LED masks for both orientations, LED 0 is at the bottom */
+#ifdef PWM_STAGGER
+#define ODD 1
+#else
+#define ODD 0
+#endif
+static const pwmLed leds[2][PWM_LED_COUNT] = {
+	{{0, 0, 1 << PB6, 0}, {1, 0, 1 << PB7, ODD}, {2, 1, 1 << PD2, 0},
+	{3, 1, 1 << PD3, ODD}, {4, 1, 1 << PD4, 0}, {5, 1, 1 << PD5, ODD}},
+	{{5, 1, 1 << PD5, ODD}, {4, 1, 1 << PD4, 0}, {3, 1, 1 << PD3, ODD},
+	{2, 1, 1 << PD2, 0}, {1, 0, 1 << PB7, ODD}, {0, 0, 1 << PB6, 0}},
+};
+#undef ODD
+/* current orientation */
+static const pwmLed *orient = leds[PWM_ORIENT_UP];
+
+/* running animation */
+static uint8_t anim = ANIM_NONE;
+/* sequence: first and current keyframe, frames left for the current one and
+ * repetitions left (0 is endless) */
+static const pwmKeyframe *seqStart, *seqCur;
+static uint8_t seqFrames, seqRepeat;
+/* cross-fade: LEDs */
+static const pwmLed *fadeFrom, *fadeTo;
+/* between pwmStart and pwmStop, timer2 is acquired and running */
+static bool running = false, clockHeld = false;
+/* shown brightness is value >> dimming */
+static uint8_t dimming = 0;
+/* show LEDs fully on or off only */
+static bool quantize = false;
+/* cross-fade step changes the shown frame, which must not be flipped */
+static volatile bool fading = false;
+#ifdef PWM_JITTER
+/* largest delay between compare match and port write, in timer2 ticks */
+static volatile uint8_t jitter = 0;
+#endif
+#ifdef PWM_STAGGER
+/* compare value, i.e. duration of each segment */
+static const uint8_t durations[PWM_SEGMENTS] = PWM_STAGGER_LENGTHS (UNIT, -1);
+/* brightness bit shown in each segment, by phase */
+static const uint8_t segmentBits[PWM_STAGGER_PHASES][PWM_SEGMENTS] =
+		PWM_STAGGER_BITS;
+#else
+static const uint8_t durations[PWM_SEGMENTS] = PWM_PLAIN_LENGTHS (UNIT, -1);
+static const uint8_t segmentBits[PWM_PLAIN_PHASES][PWM_SEGMENTS] =
+		PWM_PLAIN_BITS;
+#endif
 /* inversed(!) bitfield, indicating which LEDs are pwm-controlled */
 static const uint8_t notledbits[2] = {(uint8_t) ~((1 << PB6) | (1 << PB7)),
 		(uint8_t) ~((1 << PD2) | (1 << PD3) | (1 << PD4) | (1 << PD5))};
 
-static void enableSlow () {
-	TCCR0B = SLOW_PRESCALER;
+static void pwmSetLed (pwmFrame * const, const pwmLed * const,
+		const uint8_t);
+static void pwmSetMask (pwmFrame * const, const uint8_t);
+
+/*	Run the interrupt and timer2 only if a LED is dimmed or animated. A
+ *	static frame is held by the ports, so timer2 is released, which allows
+ *	power-down sleep.
+ */
+static void pwmUpdateClock () {
+	ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+		const pwmFrame * const f = front;
+		bool dimmed = false;
+		for (uint8_t i = 1; i < PWM_SEGMENTS && !dimmed; i++) {
+			dimmed = f->segments[i].ports[0] != f->segments[0].ports[0] ||
+					f->segments[i].ports[1] != f->segments[0].ports[1];
+		}
+		if (running && !dimmed) {
+			PORTB = f->segments[0].ports[0];
+			PORTD = f->segments[0].ports[1];
+		}
+		const bool isr = running && (dimmed || anim == ANIM_SEQUENCE || flip);
+		if (isr && !clockHeld) {
+			/* timer2 ignores writes while gated */
+			powerHold (POWER_TIMER2, &clockHeld, true);
+			/* start with a new frame */
+#ifdef PWM_ASM
+			pwmSetSegment (&front->segments[0]);
+#else
+			segment = 0;
+#endif
+			TCNT2 = 0;
+			/* the first period is the last segment, written directly in
+			 * normal mode, the next one (segment 0) into the buffer */
+			TCCR2A = 0;
+			OCR2A = durations[PWM_SEGMENTS-1];
+			TCCR2A = MODE_A;
+			OCR2A = durations[0];
+			TIMSK2 = (1 << OCIE2A);
+			TCCR2B = MODE_B | prescalers[clockCurrent ()];
+		} else if (!isr && clockHeld) {
+			TIMSK2 = 0;
+			TCCR2B = 0;
+			powerHold (POWER_TIMER2, &clockHeld, false);
+		}
+	}
+}
+
+/*	Load the next keyframe, returns false at the end of the sequence
+ */
+static bool pwmNextKeyframe () {
+	seqFrames = pgm_read_byte (&seqCur->frames);
+	if (seqFrames == 0) {
+		return false;
+	}
+	pwmSetMask (front, pgm_read_byte (&seqCur->mask));
+	++seqCur;
+	return true;
 }
 
-static void enableFast () {
-	TCCR0B = FAST_PRESCALER;
+/*	Animation finished, LEDs keep their state
+ */
+static void pwmAnimationEnd () {
+	if (anim == ANIM_CROSSFADE) {
+		timerStop (TIMER_PWM);
+	}
+	anim = ANIM_NONE;
+	enableWakeup (WAKE_ANIMATION);
+	pwmUpdateClock ();
 }
 
-ISR(TIMER0_COMPA_vect) {
-	if (speakerCount > 0) {
-		--speakerCount;
-		/* stop speaker after beep */
-		if (speakerCount == 0) {
-			/* in speakerStart we set every 2nd to 1 */
-			for (uint8_t i = 0; i < PWM_MAX_BRIGHTNESS; i += 2) {
-				pwmvalue[i][1] &= ~(1 << PD6);
+/*	Advance the animation by one frame
+ */
+static void pwmAnimateFrame () {
+	switch (anim) {
+		case ANIM_SEQUENCE:
+			--seqFrames;
+			if (seqFrames == 0 && !pwmNextKeyframe ()) {
+				/* wrap around */
+				if (seqRepeat != 1) {
+					if (seqRepeat > 0) {
+						--seqRepeat;
+					}
+					seqCur = seqStart;
+					pwmNextKeyframe ();
+				} else {
+					pwmAnimationEnd ();
+				}
 			}
-			enableSlow ();
-		}
+			break;
+
+		default:
+			break;
 	}
+}
 
-	PORTB = pwmvalue[count][0];
-	PORTD = pwmvalue[count][1];
+/*	Move one brightness level of the cross-fade, timer service callback.
+ *	Changes the shown frame, like the sequence does at frame end; interrupts
+ *	are enabled, so the frame end postpones flips meanwhile.
+ */
+static void pwmFadeStep () {
+	if (anim != ANIM_CROSSFADE) {
+		return;
+	}
+	pwmFrame *f;
+	ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+		fading = true;
+		f = front;
+	}
+	uint8_t * const v = f->values;
+	if (v[fadeFrom->id] > 0 && v[fadeTo->id] < PWM_MAX_BRIGHTNESS) {
+		pwmSetLed (f, fadeFrom, v[fadeFrom->id]-1);
+		pwmSetLed (f, fadeTo, v[fadeTo->id]+1);
+	}
+	ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+		fading = false;
+	}
+	if (v[fadeFrom->id] == 0 || v[fadeTo->id] == PWM_MAX_BRIGHTNESS) {
+		pwmAnimationEnd ();
+	} else {
+		pwmUpdateClock ();
+	}
+}
 
-	/* auto wrap-around */
-	count = (count+1) & (PWM_MAX_BRIGHTNESS-1);
+/*	Show the back buffer, the new back buffer starts as a copy of it
+ */
+static void pwmFlip () {
+	pwmFrame * const f = front;
+	front = back;
+	back = f;
+#ifdef PWM_ASM
+	/* the interrupt points into the shown frame */
+	pwmSetSegment (&front->segments[pwmGetSegment () - &f->segments[0]]);
+#endif
+	memcpy (back, front, sizeof (*back));
+	flip = false;
+}
 
-	/* no wakeup */
+/*	Prepare the next frame, at the start of the last segment. This is the
+ *	longest one, short ones would be stretched.
+ */
+static void pwmFrameEnd () {
+	if (flip && !fading) {
+		pwmFlip ();
+		pwmUpdateClock ();
+	}
+	pwmAnimateFrame ();
 }
 
-static uint8_t ledToArray (const uint8_t i) {
-	assert (i < PWM_LED_COUNT);
-	if (i >= 2) {
-		return 1;
+#ifdef PWM_ASM
+#define STR(x) #x
+#define XSTR(x) STR(x)
+
+/*	Compare b is never enabled, its vector runs the frame end in C for the
+ *	assembler interrupt below
+ */
+ISR(TIMER2_COMPB_vect) {
+	pwmSetSegment (&front->segments[0]);
+	pwmFrameEnd ();
+}
+
+/*	Show the next segment. Neither ld, in, out, sts nor sbrc change SREG, so
+ *	it is not saved. OCR2A is outside the i/o space and needs sts. Cycles,
+ *	including 4 for the interrupt response and 2 for the vector’s rjmp:
+ *
+ *	4+2 + push 6 + in 2 + ld 8 + out 4 + sts 2 + sbrc 2 + pop 6 + reti 4 = 40
+ *
+ *	Per frame that is 11*40 = 440 of 8064 cycles at 1 MHz (5%), instead of
+ *	~70 each for the C version. The last segment skips the reti and
+ *	continues in the frame end handler. PWM_JITTER adds 19 cycles. Build
+ *	with PWM_CYCLES to measure both on the device, see pwmCyclesDump.
+ */
+ISR(TIMER2_COMPA_vect, ISR_NAKED) {
+	asm volatile (
+		"push r24\n"
+		"push r30\n"
+		"push r31\n"
+		"in r30, %[ptrl]\n"
+		"in r31, %[ptrh]\n"
+		/* duration of the next segment, buffered until this one ends */
+		"ld r24, Z+\n"
+		"sts %[ocr], r24\n"
+		"ld r24, Z+\n"
+		"out %[portb], r24\n"
+		"ld r24, Z+\n"
+		"out %[portd], r24\n"
+#ifdef PWM_JITTER
+		/* timer2 counts from the compare match */
+		"push r25\n"
+		"in r25, __SREG__\n"
+		"push r25\n"
+		"lds r24, %[tcnt]\n"
+		"lds r25, %[jitter]\n"
+		"cp r25, r24\n"
+		"brsh 2f\n"
+		"sts %[jitter], r24\n"
+		"2:\n"
+		"pop r25\n"
+		"out __SREG__, r25\n"
+		"pop r25\n"
+#endif
+		"ld r24, Z+\n"
+		"out %[ptrl], r30\n"
+		"out %[ptrh], r31\n"
+		"sbrc r24, %[last]\n"
+		"rjmp 1f\n"
+		"pop r31\n"
+		"pop r30\n"
+		"pop r24\n"
+		"reti\n"
+		"1:\n"
+		"pop r31\n"
+		"pop r30\n"
+		"pop r24\n"
+		"rjmp " XSTR (TIMER2_COMPB_vect) "\n"
+		:
+		: [ptrl] "I" (_SFR_IO_ADDR (GPIOR1)),
+		[ptrh] "I" (_SFR_IO_ADDR (GPIOR2)),
+		[ocr] "n" (_SFR_MEM_ADDR (OCR2A)),
+		[portb] "I" (_SFR_IO_ADDR (PORTB)),
+		[portd] "I" (_SFR_IO_ADDR (PORTD)),
+		[last] "I" (SEGMENT_LAST)
+#ifdef PWM_JITTER
+		, [tcnt] "n" (_SFR_MEM_ADDR (TCNT2)),
+		[jitter] "i" (&jitter)
+#endif
+		);
+}
+#else
+ISR(TIMER2_COMPA_vect) {
+	/* duration of the next segment, buffered until this one ends */
+	const uint8_t p = segment;
+	const pwmSegment * const s = &front->segments[p];
+	OCR2A = s->ocr;
+	PORTB = s->ports[0];
+	PORTD = s->ports[1];
+#ifdef PWM_JITTER
+	/* timer2 counts from the compare match */
+	const uint8_t late = TCNT2;
+	if (late > jitter) {
+		jitter = late;
+	}
+#endif
+
+	if (p == PWM_SEGMENTS-1) {
+		segment = 0;
+		pwmFrameEnd ();
 	} else {
-		return 0;
+		segment = p+1;
 	}
-}
 
-static uint8_t ledToShift (const uint8_t i) {
-	assert (i < PWM_LED_COUNT);
-	static const uint8_t shifts[] = {PB6, PB7, PD2, PD3, PD4, PD5};
-	return shifts[i];
+	/* no wakeup */
 }
+#endif
 
 void pwmInit () {
 	/* set led1,led2 to output */
@@ -100,73 +450,324 @@ void pwmInit () {
 	/* gyro uses pb1, get its setup; this function must be called after gyro setup */
 	const uint8_t pbdef = PORTB;
 	const uint8_t pddef = PORTD;
-	for (uint8_t i = 0; i < PWM_MAX_BRIGHTNESS; i++) {
-		pwmvalue[i][0] = pbdef;
-		pwmvalue[i][1] = pddef;
+	for (uint8_t i = 0; i < PWM_SEGMENTS; i++) {
+		pwmSegment * const s = &frames[0].segments[i];
+		s->ocr = durations[(i+1) % PWM_SEGMENTS];
+		s->ports[0] = pbdef;
+		s->ports[1] = pddef;
+		s->flags = i == PWM_SEGMENTS-1 ? (1 << SEGMENT_LAST) : 0;
+	}
+	frames[1] = frames[0];
+
+	TCCR2A = MODE_A;
+
+	timerSetCallback (TIMER_PWM, pwmFadeStep);
+}
+
+/*	Cpu clock changed to s, called by the clock manager with interrupts
+ *	disabled
+ */
+void pwmClock (const clockSpeed s) {
+	if (clockHeld) {
+		TCCR2B = MODE_B | prescalers[s];
 	}
 }
 
 void pwmStart () {
-	count = 0;
-	/* reset timer value */
-	TCNT0 = 0;
-	/* set ctc timer0 (part 1) */
-	TCCR0A = (1 << WGM01);
-	/* enable compare match interrupt */
-	TIMSK0 = (1 << OCIE0A);
-	/* compare value */
-	OCR0A = 1;
-	enableSlow ();
+	running = true;
+	pwmUpdateClock ();
 }
 
 void pwmStop () {
-	/* zero clock source */
-	TCCR0B = 0;
+	running = false;
+	timerStop (TIMER_PWM);
+	anim = ANIM_NONE;
+	if (flip) {
+		/* the interrupt will not do it */
+		ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+			pwmFlip ();
+		}
+	}
+	pwmUpdateClock ();
 	PORTB &= notledbits[0];
 	PORTD &= notledbits[1];
 }
 
-/*	Set LED brightness
- *
- *	We could switch off interrupts here. Instead use pwmStart/Stop.
+/*	Set brightness of LED in frame f
+ */
+static void pwmSetLed (pwmFrame * const f, const pwmLed * const led,
+		const uint8_t value) {
+	const uint8_t array = led->array;
+	const uint8_t bit = led->bit;
+	const uint8_t * const bits = segmentBits[led->phase];
+	uint8_t shown = value >> dimming;
+	if (quantize) {
+		/* no pwm needed, at most one of two fading LEDs is on */
+		shown = value > PWM_MAX_BRIGHTNESS/2 ? PWM_ON : PWM_OFF;
+	}
+
+	f->values[led->id] = value;
+	for (uint8_t j = 0; j < PWM_SEGMENTS; j++) {
+		if ((shown >> bits[j]) & 0x1) {
+			f->segments[j].ports[array] |= bit;
+		} else {
+			f->segments[j].ports[array] &= ~bit;
+		}
+	}
+}
+
+/*	Switch LEDs in mask (bit i is LED i) on, all others off
+ */
+static void pwmSetMask (pwmFrame * const f, const uint8_t mask) {
+	for (uint8_t i = 0; i < PWM_LED_COUNT; i++) {
+		pwmSetLed (f, &orient[i], ((mask >> i) & 0x1) ? PWM_ON : PWM_OFF);
+	}
+}
+
+/*	The back buffer is still waiting to be shown, wait for the frame
+ *	boundary (at most one frame) before drawing into it again. With
+ *	interrupts disabled (i.e. an assert in an isr) the frame boundary never
+ *	comes, flip right away instead.
+ */
+static void pwmWaitFlip () {
+	if (!(SREG & (1 << SREG_I))) {
+		if (flip) {
+			pwmFlip ();
+		}
+		return;
+	}
+	while (flip);
+}
+
+/*	Set LED brightness in the back buffer, LED 0 is at the bottom of the
+ *	current orientation
  */
 void pwmSet (const uint8_t i, const uint8_t value) {
 	assert (i < PWM_LED_COUNT);
 	assert (value <= PWM_MAX_BRIGHTNESS);
 
-	const uint8_t array = ledToArray (i);
-	const uint8_t bit = 1 << ledToShift (i);
+	pwmWaitFlip ();
+	pwmSetLed (back, &orient[i], value);
+}
 
-	for (uint8_t j = 0; j < value; j++) {
-		pwmvalue[j][array] |= bit;
+/*	Switch all LEDs in the back buffer off
+ */
+void pwmSetOff () {
+	pwmWaitFlip ();
+	for (uint8_t i = 0; i < PWM_SEGMENTS; i++) {
+		back->segments[i].ports[0] &= notledbits[0];
+		back->segments[i].ports[1] &= notledbits[1];
 	}
-	for (uint8_t j = value; j < PWM_MAX_BRIGHTNESS; j++) {
-		pwmvalue[j][array] &= ~bit;
+	memset (back->values, 0, sizeof (back->values));
+}
+
+/*	Show the back buffer, at the next frame boundary if the interrupt is
+ *	running, immediately otherwise. Replaces changes made by animations.
+ */
+void pwmCommit () {
+	ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+		if (!flip) {
+			if (clockHeld) {
+				flip = true;
+			} else {
+				pwmFlip ();
+			}
+			pwmUpdateClock ();
+		}
 	}
 }
 
-/*	Switch all LEDs off
+/*	Show the back buffer now and stop the interrupt. LEDs with any brightness
+ *	are fully on, regardless of dimming and stagger. For the error display,
+ *	works with interrupts disabled.
  */
-void pwmSetOff () {
-	for (uint8_t i = 0; i < PWM_MAX_BRIGHTNESS; i++) {
-		pwmvalue[i][0] &= notledbits[0];
-		pwmvalue[i][1] &= notledbits[1];
+void pwmShowNow () {
+	ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+		TIMSK2 = 0;
+		TCCR2B = 0;
+		anim = ANIM_NONE;
+		pwmFlip ();
+		uint8_t ports[2] = {PORTB & notledbits[0], PORTD & notledbits[1]};
+		for (uint8_t i = 0; i < PWM_LED_COUNT; i++) {
+			const pwmLed * const led = &orient[i];
+			if (front->values[led->id] != PWM_OFF) {
+				ports[led->array] |= led->bit;
+			}
+		}
+		PORTB = ports[0];
+		PORTD = ports[1];
 	}
 }
 
-void speakerStart (const speakerMode mode __unused__) {
-	enableFast ();
-	for (uint8_t i = 0; i < PWM_MAX_BRIGHTNESS; i += 2) {
-		pwmvalue[i][1] |= (1 << PD6);
+/*	Divide brightness by 2^shift, applies to LEDs drawn from now on
+ */
+void pwmSetDimming (const uint8_t shift) {
+	assert (shift < PWM_PLANES);
+	dimming = shift;
+}
+
+/*	Show LEDs drawn from now on fully on if they are brighter than half
+ *	and off otherwise, instead of dimming them. Frames are static then and
+ *	timer2 is stopped between cross-fade steps, which allows power-down
+ *	sleep. Brightness values are kept as they are.
+ */
+void pwmSetQuantize (const bool enable) {
+	quantize = enable;
+}
+
+/*	Select LED order, LED 0 is at the bottom of the device
+ */
+void pwmSetOrientation (const pwmOrientation o) {
+	assert (o == PWM_ORIENT_UP || o == PWM_ORIENT_DOWN);
+	orient = leds[o];
+}
+
+/*	Play keyframe sequence seq (in program memory, terminated by
+ *	PWM_KEYFRAME_END) repeat times, 0 repeats forever. Replaces the current
+ *	animation.
+ */
+void pwmPlay (const pwmKeyframe * const seq, const uint8_t repeat) {
+	disableWakeup (WAKE_ANIMATION);
+	timerStop (TIMER_PWM);
+	ATOMIC_BLOCK (ATOMIC_FORCEON) {
+		anim = ANIM_SEQUENCE;
+		seqStart = seq;
+		seqCur = seq;
+		seqRepeat = repeat;
+		pwmNextKeyframe ();
+		pwmUpdateClock ();
 	}
-	/* 12.8ms */
-	speakerCount = 100;
 }
 
-void speakerInit () {
-	/* set PD6 to output */
-	DDRD |= (1 << PD6);
-	/* turn off */
-	PORTD = PORTD & ~(1 << PD6);
+/*	Move brightness from LED from to LED to within ms, one level at a time,
+ *	i.e. a full fade takes PWM_MAX_BRIGHTNESS steps. Ends when from is off or
+ *	to is fully on. Replaces the current animation.
+ */
+void pwmCrossfade (const uint8_t from, const uint8_t to, const uint32_t ms) {
+	assert (from < PWM_LED_COUNT && to < PWM_LED_COUNT);
+	disableWakeup (WAKE_ANIMATION);
+	ATOMIC_BLOCK (ATOMIC_FORCEON) {
+		anim = ANIM_CROSSFADE;
+		fadeFrom = &orient[from];
+		fadeTo = &orient[to];
+		timerStartSteps (TIMER_PWM, ms, PWM_MAX_BRIGHTNESS, false);
+		pwmUpdateClock ();
+	}
 }
 
+/*	Check if the animation finished since the last call
+ */
+bool pwmAnimationDone () {
+	bool ret = false;
+	if (shouldWakeup (WAKE_ANIMATION)) {
+		disableWakeup (WAKE_ANIMATION);
+		ret = true;
+	}
+	return ret;
+}
+
+/*	Highest number of LEDs on at the same time in the shown frame, for
+ *	checking the stagger layout
+ */
+uint8_t pwmPeakCount () {
+	uint8_t peak = 0;
+	for (uint8_t i = 0; i < PWM_SEGMENTS; i++) {
+		uint8_t count = 0;
+		for (uint8_t j = 0; j < PWM_LED_COUNT; j++) {
+			const pwmLed * const led = &leds[0][j];
+			if (front->segments[i].ports[led->array] & led->bit) {
+				++count;
+			}
+		}
+		if (count > peak) {
+			peak = count;
+		}
+	}
+	return peak;
+}
+
+#ifdef PWM_JITTER
+/*	Get and reset the largest delay between a compare match and the port
+ *	write (us), with a resolution of one timer tick (128/UNIT us)
+ */
+uint16_t pwmJitter () {
+	uint8_t ret;
+	ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+		ret = jitter;
+		jitter = 0;
+	}
+	return ret*(128/UNIT);
+}
+#endif
+
+#ifdef PWM_CYCLES
+/*	Let a pending interrupt run between two reads of timer0, which counts
+ *	cpu cycles. Interrupts must be disabled.
+ */
+static uint16_t pwmBracket () {
+	uint8_t t;
+	TCNT0 = 0;
+	TIFR0 = (1 << TOV0);
+	/* the instruction after sei runs first, the one after reti as well */
+	asm volatile (
+		"sei\n"
+		"nop\n"
+		"cli\n"
+		"in %0, %1\n"
+		: "=r" (t)
+		: "I" (_SFR_IO_ADDR (TCNT0))
+		: "memory");
+	return t + ((TIFR0 & (1 << TOV0)) ? 256 : 0);
+}
+
+/*	Measure the compare interrupt and print the result next to the count
+ *	documented above. Waits for every compare match of four frames with
+ *	interrupts disabled and runs the interrupt between two reads of timer0,
+ *	minus the cost of the reads alone. Results include the interrupt
+ *	response and reti; the last segment includes the frame end. Other
+ *	interrupts may run in between, so the minimum per segment is used.
+ *	The pwm interrupt must be running and the speaker idle. Segment
+ *	durations are off while measuring, since compare values are written late.
+ */
+void pwmCyclesDump () {
+	uint16_t cycles[PWM_SEGMENTS];
+	memset (cycles, 0xff, sizeof (cycles));
+	bool timer0 = false;
+	ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+		powerHold (POWER_TIMER0, &timer0, true);
+		const uint8_t tccr0a = TCCR0A, tccr0b = TCCR0B;
+		/* normal mode, no prescaler */
+		TCCR0A = 0;
+		TCCR0B = (1 << CS00);
+
+		TIMSK2 = 0;
+		const uint16_t base = pwmBracket ();
+		TIMSK2 = (1 << OCIE2A);
+		for (uint8_t i = 0; i < 4*PWM_SEGMENTS; i++) {
+			while (!(TIFR2 & (1 << OCF2A)));
+#ifdef PWM_ASM
+			const uint8_t j = pwmGetSegment () - &front->segments[0];
+#else
+			const uint8_t j = segment;
+#endif
+			const uint16_t c = pwmBracket () - base;
+			if (c < cycles[j]) {
+				cycles[j] = c;
+			}
+		}
+
+		TCCR0B = tccr0b;
+		TCCR0A = tccr0a;
+		powerHold (POWER_TIMER0, &timer0, false);
+	}
+
+	uint16_t worst = 0;
+	for (uint8_t j = 0; j < PWM_SEGMENTS-1; j++) {
+		if (cycles[j] > worst) {
+			worst = cycles[j];
+		}
+	}
+	printf ("pwm isr %u cycles (documented 40), frame end %u\n", worst,
+			cycles[PWM_SEGMENTS-1]);
+}
+#endif
@@ -25,23 +25,65 @@ THE SOFTWARE.
 #define PWM_H
 
 #include <stdint.h>
+#include <stdbool.h>
+
+#include "clock.h"
+#include "pwmlayout.h"
+
 void pwmInit ();
+void pwmClock (const clockSpeed);
 void pwmStart ();
 void pwmStop ();
 void pwmSet (const uint8_t, const uint8_t);
 void pwmSetOff ();
+void pwmCommit ();
+void pwmShowNow ();
+void pwmSetDimming (const uint8_t);
+void pwmSetQuantize (const bool);
+
+/* LED order, LED 0 is at PB6 (up) or PD5 (down) */
+typedef uint8_t pwmOrientation;
+#define PWM_ORIENT_UP 0
+#define PWM_ORIENT_DOWN 1
+
+void pwmSetOrientation (const pwmOrientation);
+
+/* animation keyframe: LEDs on (bit i is LED i) for a number of frames */
+typedef struct {
+	uint8_t mask;
+	uint8_t frames;
+} pwmKeyframe;
+
+/* sequence terminator */
+#define PWM_KEYFRAME_END {0, 0}
+/* all LEDs */
+#define PWM_ALL_LEDS ((1 << PWM_LED_COUNT)-1)
+/* frame duration (us), PWM_MAX_BRIGHTNESS units of 128 us */
+#define PWM_FRAME_US ((uint32_t) PWM_MAX_BRIGHTNESS*128)
+/* ms to frames, at least one */
+#define PWM_MS_FRAMES(ms) ((uint8_t) ((ms)*1000 < PWM_FRAME_US ? 1 : \
+		((uint32_t) (ms)*1000 + PWM_FRAME_US/2)/PWM_FRAME_US))
 
-typedef uint8_t speakerMode;
-#define SPEAKER_BEEP 0
+void pwmPlay (const pwmKeyframe * const, const uint8_t);
+void pwmCrossfade (const uint8_t, const uint8_t, const uint32_t);
+bool pwmAnimationDone ();
+uint8_t pwmPeakCount ();
 
-void speakerStart (const speakerMode);
+/* define PWM_JITTER (i.e. make CFLAGS+=-DPWM_JITTER) to record the worst
+ * delay of the pwm interrupt, see pwmJitter */
+#ifdef PWM_JITTER
+uint16_t pwmJitter ();
+#endif
 
-#define PWM_LED_COUNT 6
+/* define PWM_CYCLES to measure the cycles taken by the pwm interrupt at
+ * startup and print them, see pwmCyclesDump */
+#ifdef PWM_CYCLES
+void pwmCyclesDump ();
+#endif
 
-#define PWM_OFF 0
-/* must be power-of-two */
-#define PWM_MAX_BRIGHTNESS 8
-#define PWM_ON PWM_MAX_BRIGHTNESS
+/* stagger odd LEDs by half a frame to lower the peak current, comment out
+ * for plain binary code modulation */
+#define PWM_STAGGER
 
 #endif /* PWM_H */
 
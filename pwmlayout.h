@@ -0,0 +1,66 @@
+/*
+Copyright (c) 2014-2015
+	Lars-Dominik Braun <lars@6xq.net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/*	Brightness levels and segment layouts of the pwm, free of avr
+ *	dependencies for the host check in test/pwmpeak.c
+ */
+
+#ifndef PWMLAYOUT_H
+#define PWMLAYOUT_H
+
+#define PWM_LED_COUNT 6
+
+/* number of brightness bits */
+#define PWM_PLANES 6
+
+#define PWM_OFF 0
+#define PWM_MAX_BRIGHTNESS ((1 << PWM_PLANES)-1)
+#define PWM_ON PWM_MAX_BRIGHTNESS
+
+/* segment lengths are in time units of u timer counts, plus o */
+
+/* plain binary code modulation: one segment per brightness bit */
+#define PWM_PLAIN_SEGMENTS PWM_PLANES
+#define PWM_PLAIN_PHASES 1
+#define PWM_PLAIN_LENGTHS(u,o) {1*(u)+(o), 2*(u)+(o), 4*(u)+(o), 8*(u)+(o), \
+		16*(u)+(o), 32*(u)+(o)}
+#define PWM_PLAIN_BITS { \
+	{0, 1, 2, 3, 4, 5}, \
+}
+
+/* staggered: bit 5 is split into halves of 16 units, one in each half of
+ * the frame, and odd LEDs (phase 1) show bits 0..4 while even ones show
+ * bit 5 and vice versa. Below bit 5 even and odd LEDs never share a
+ * segment, at every level both phases have the same duty. The last segment
+ * is a long one, see pwmFrameEnd. */
+#define PWM_STAGGER_SEGMENTS 11
+#define PWM_STAGGER_PHASES 2
+#define PWM_STAGGER_LENGTHS(u,o) {1*(u)+(o), 2*(u)+(o), 4*(u)+(o), \
+		8*(u)+(o), 1*(u)+(o), 1*(u)+(o), 2*(u)+(o), 4*(u)+(o), 8*(u)+(o), \
+		16*(u)+(o), 16*(u)+(o)}
+#define PWM_STAGGER_BITS { \
+	{5, 5, 5, 5, 5, 0, 1, 2, 3, 5, 4}, \
+	{0, 1, 2, 3, 5, 5, 5, 5, 5, 4, 5}, \
+}
+
+#endif /* PWMLAYOUT_H */
@@ -0,0 +1,169 @@
+/*
+Copyright (c) 2014-2015
+	Lars-Dominik Braun <lars@6xq.net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/*	Speaker on PD6/OC0A, uses timer0
+ *
+ *	The tone is generated by the hardware, which toggles the pin on every
+ *	compare match in ctc mode. Note lengths are counted by the timer service,
+ *	so the cpu only works once per note.
+ */
+
+#include "common.h"
+
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <stdlib.h>
+#include <util/atomic.h>
+
+#include "speaker.h"
+#include "timer.h"
+#include "power.h"
+
+/* the fast clock needs a divider CLOCK_SCALE times larger; if timer0 does
+ * not have it the next one is used and compare values are halved */
+#if CLOCK_CS01 (SPEAKER_DIVIDER*CLOCK_SCALE) != 0
+#define DIVIDER_FAST (SPEAKER_DIVIDER*CLOCK_SCALE)
+#define SHIFT_FAST 0
+#else
+#define DIVIDER_FAST (SPEAKER_DIVIDER*CLOCK_SCALE*2)
+#define SHIFT_FAST 1
+#endif
+#if CLOCK_CS01 (DIVIDER_FAST) == 0
+#error "cpu speed not supported"
+#endif
+static const uint8_t prescalers[CLOCK_SPEEDS] = {CLOCK_CS01 (SPEAKER_DIVIDER),
+		CLOCK_CS01 (DIVIDER_FAST)};
+static const uint8_t shifts[CLOCK_SPEEDS] = {0, SHIFT_FAST};
+
+/* 50 ms beep */
+static const speakerNote beep[] PROGMEM = {
+	SPEAKER_NOTE (1000, 50),
+	SPEAKER_END,
+};
+/* rising triple */
+static const speakerNote alarm[] PROGMEM = {
+	SPEAKER_NOTE (2000, 80),
+	SPEAKER_REST (40),
+	SPEAKER_NOTE (2500, 80),
+	SPEAKER_REST (40),
+	SPEAKER_NOTE (3000, 160),
+	SPEAKER_END,
+};
+static const speakerNote * const sequences[] = {beep, alarm};
+
+/* next note */
+static const speakerNote *note = NULL;
+/* timer0 is acquired */
+static bool held = false;
+/* compare value of the current tone at the slow clock */
+static uint8_t tone = 0;
+
+/*	Disconnect oc0a, the pin falls back to the port value (off), and stop
+ *	the clock
+ */
+static void speakerOff () {
+	if (held) {
+		TCCR0A = (1 << WGM01);
+		TCCR0B = 0;
+		powerHold (POWER_TIMER0, &held, false);
+	}
+}
+
+/*	Play the next note, timer service callback
+ */
+static void speakerNext () {
+	const uint16_t ticks = pgm_read_word (&note->ticks);
+	if (ticks == 0) {
+		speakerOff ();
+		note = NULL;
+		return;
+	}
+
+	const uint8_t ocr = pgm_read_byte (&note->ocr);
+	if (ocr == 0) {
+		speakerOff ();
+	} else {
+		/* a clock change in between would use the old tone */
+		ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+			/* timer0 ignores writes while gated */
+			powerHold (POWER_TIMER0, &held, true);
+			tone = ocr;
+			speakerClock (clockCurrent ());
+			TCCR0A = (1 << COM0A0) | (1 << WGM01);
+		}
+	}
+	++note;
+	timerStartTicks (TIMER_SPEAKER, ticks);
+}
+
+/*	Cpu clock changed to s, restart the tone with the divider and compare
+ *	value for s. Called by the clock manager with interrupts disabled.
+ */
+void speakerClock (const clockSpeed s) {
+	if (held) {
+		OCR0A = tone >> shifts[s];
+		/* the counter may be past the new compare value */
+		TCNT0 = 0;
+		TCCR0B = prescalers[s];
+	}
+}
+
+void speakerInit () {
+	/* set PD6 to output */
+	DDRD |= (1 << PD6);
+	/* turn off */
+	PORTD = PORTD & ~(1 << PD6);
+	/* ctc, disconnected */
+	TCCR0A = (1 << WGM01);
+	TCCR0B = 0;
+	timerSetCallback (TIMER_SPEAKER, speakerNext);
+}
+
+/*	Play sequence seq (in program memory, terminated by SPEAKER_END),
+ *	replaces the current one
+ */
+void speakerPlay (const speakerNote * const seq) {
+#ifdef TW_PROFILE
+	/* timer0 is the i2c profiler clock */
+	return;
+#endif
+	ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+		note = seq;
+		speakerNext ();
+	}
+}
+
+/*	Play built-in sequence
+ */
+void speakerStart (const speakerMode mode) {
+	assert (mode < sizeof (sequences)/sizeof (*sequences));
+	speakerPlay (sequences[mode]);
+}
+
+void speakerStop () {
+	ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+		timerStop (TIMER_SPEAKER);
+		speakerOff ();
+		note = NULL;
+	}
+}
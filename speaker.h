@@ -0,0 +1,67 @@
+/*
+Copyright (c) 2014-2015
+	Lars-Dominik Braun <lars@6xq.net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef SPEAKER_H
+#define SPEAKER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "common.h"
+#include "timer.h"
+
+/* timer0 divider at the slow clock, sets the tone range: the smallest one
+ * counting at 125 kHz at most, i.e. 245 Hz to 62.5 kHz at 1 MHz and 123/245 Hz
+ * to 31/62.5 kHz at 4/8 MHz */
+#if F_CPU/8 <= 125000
+#define SPEAKER_DIVIDER 8
+#else
+#define SPEAKER_DIVIDER 64
+#endif
+
+/* note: compare value (0 is a rest) and length in timer ticks */
+typedef struct {
+	uint8_t ocr;
+	uint16_t ticks;
+} speakerNote;
+
+/* compare value for tone hz, the pin is toggled twice per period */
+#define SPEAKER_HZ(hz) ((uint8_t) (((uint32_t) F_CPU/SPEAKER_DIVIDER + (hz))/ \
+		(2*(uint32_t) (hz)) - 1))
+#define SPEAKER_NOTE(hz, ms) {SPEAKER_HZ (hz), TIMER_MS_TICKS (ms)}
+#define SPEAKER_REST(ms) {0, TIMER_MS_TICKS (ms)}
+/* sequence terminator */
+#define SPEAKER_END {0, 0}
+
+/* built-in sequences */
+typedef uint8_t speakerMode;
+#define SPEAKER_BEEP 0
+#define SPEAKER_ALARM 1
+
+void speakerInit ();
+void speakerClock (const clockSpeed);
+void speakerStart (const speakerMode);
+void speakerPlay (const speakerNote * const);
+void speakerStop ();
+
+#endif /* SPEAKER_H */
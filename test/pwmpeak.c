@@ -0,0 +1,155 @@
+/*
+Copyright (c) 2014-2015
+	Lars-Dominik Braun <lars@6xq.net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/*	Host check of the pwm segment layouts: builds frames the way pwmSetLed
+ *	does and compares the highest number of LEDs on at the same time,
+ *	plain binary code modulation vs. staggered, at equal brightness. Run
+ *	with make check.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "pwmlayout.h"
+
+static const uint8_t plainLengths[PWM_PLAIN_SEGMENTS] =
+		PWM_PLAIN_LENGTHS (1, 0);
+static const uint8_t plainBits[PWM_PLAIN_PHASES][PWM_PLAIN_SEGMENTS] =
+		PWM_PLAIN_BITS;
+static const uint8_t staggerLengths[PWM_STAGGER_SEGMENTS] =
+		PWM_STAGGER_LENGTHS (1, 0);
+static const uint8_t staggerBits[PWM_STAGGER_PHASES][PWM_STAGGER_SEGMENTS] =
+		PWM_STAGGER_BITS;
+
+static unsigned int failed = 0;
+
+/*	Peak of a frame with LED i at values[i]; odd LEDs use the last phase
+ */
+static unsigned int peak (const uint8_t *bits, const unsigned int phases,
+		const unsigned int segments, const uint8_t * const values) {
+	unsigned int ret = 0;
+	for (unsigned int j = 0; j < segments; j++) {
+		unsigned int count = 0;
+		for (unsigned int i = 0; i < PWM_LED_COUNT; i++) {
+			const unsigned int phase = (i & 0x1) ? phases-1 : 0;
+			if ((values[i] >> bits[phase*segments+j]) & 0x1) {
+				++count;
+			}
+		}
+		if (count > ret) {
+			ret = count;
+		}
+	}
+	return ret;
+}
+
+static unsigned int plainPeak (const uint8_t * const values) {
+	return peak (&plainBits[0][0], PWM_PLAIN_PHASES, PWM_PLAIN_SEGMENTS,
+			values);
+}
+
+static unsigned int staggerPeak (const uint8_t * const values) {
+	return peak (&staggerBits[0][0], PWM_STAGGER_PHASES,
+			PWM_STAGGER_SEGMENTS, values);
+}
+
+/*	Each phase must show bit p for 2^p units, i.e. every level has the same
+ *	duty as with plain binary code modulation
+ */
+static void checkDuty (const char * const what, const uint8_t *bits,
+		const unsigned int phases, const unsigned int segments,
+		const uint8_t * const lengths) {
+	for (unsigned int phase = 0; phase < phases; phase++) {
+		for (unsigned int p = 0; p < PWM_PLANES; p++) {
+			unsigned int units = 0;
+			for (unsigned int j = 0; j < segments; j++) {
+				if (bits[phase*segments+j] == p) {
+					units += lengths[j];
+				}
+			}
+			if (units != 1U << p) {
+				printf ("%s phase %u shows bit %u for %u units\n", what,
+						phase, p, units);
+				++failed;
+			}
+		}
+	}
+}
+
+static void expect (const char * const what, const unsigned int got,
+		const unsigned int want) {
+	printf ("%-32s %u\n", what, got);
+	if (got != want) {
+		printf ("  expected %u\n", want);
+		++failed;
+	}
+}
+
+/*	All LEDs at value
+ */
+static void fill (uint8_t * const values, const uint8_t value) {
+	for (unsigned int i = 0; i < PWM_LED_COUNT; i++) {
+		values[i] = value;
+	}
+}
+
+int main () {
+	uint8_t values[PWM_LED_COUNT];
+
+	checkDuty ("plain", &plainBits[0][0], PWM_PLAIN_PHASES,
+			PWM_PLAIN_SEGMENTS, plainLengths);
+	checkDuty ("stagger", &staggerBits[0][0], PWM_STAGGER_PHASES,
+			PWM_STAGGER_SEGMENTS, staggerLengths);
+
+	/* same level on all LEDs: never worse than plain, and below bit 5 even
+	 * and odd LEDs are on in disjoint segments */
+	for (unsigned int v = 1; v <= PWM_MAX_BRIGHTNESS; v++) {
+		fill (values, v);
+		const unsigned int plain = plainPeak (values),
+				stagger = staggerPeak (values);
+		if (plain != PWM_LED_COUNT || stagger > plain ||
+				(v < (1 << (PWM_PLANES-1)) && stagger != PWM_LED_COUNT/2)) {
+			printf ("level %u peak plain %u stagger %u\n", v, plain, stagger);
+			++failed;
+		}
+	}
+
+	/* all-on flash and startup test, fully on cannot be staggered */
+	fill (values, PWM_ON);
+	expect ("plain flash", plainPeak (values), PWM_LED_COUNT);
+	expect ("stagger flash", staggerPeak (values), PWM_LED_COUNT);
+	/* half brightness */
+	fill (values, PWM_MAX_BRIGHTNESS/2);
+	expect ("plain half", plainPeak (values), PWM_LED_COUNT);
+	expect ("stagger half", staggerPeak (values), PWM_LED_COUNT/2);
+
+	/* run: one LED fading out, the next fading in */
+	fill (values, PWM_OFF);
+	values[2] = 21;
+	values[3] = 11;
+	expect ("plain crossfade", plainPeak (values), 2);
+	expect ("stagger crossfade", staggerPeak (values), 1);
+
+	return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,301 @@
+/*
+Copyright (c) 2014-2015
+	Lars-Dominik Braun <lars@6xq.net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/*	Host simulation of the i2c engine: runs i2c.c against a model of the twi
+ *	and the bus, injects NACKs, arbitration loss and a slave holding sda low,
+ *	and measures the time until the request is done. Run with make check.
+ *
+ *	The twi model reacts to the register values the engine leaves behind: a
+ *	TWCR with TWINT set starts the next action, which completes after the
+ *	bus time of its bits and calls the interrupt handler.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+/* the engine, built against the register model in test/sim */
+#include "../i2c.c"
+
+uint8_t TWBR, TWSR = TW_NO_INFO, TWCR, TWDR, PORTC, DDRC, PINC, GPIOR0;
+
+#define NEVER UINT32_MAX
+
+/* simulated time (us) */
+static uint32_t now = 0;
+/* TIMER_I2C deadline and callback */
+static uint32_t timerDeadline = NEVER;
+static timerCallback timerCb = NULL;
+/* twi action in progress: TWCR and TWDR when it was started, completion */
+static uint8_t twiCtrl, twiData;
+static uint32_t twiDeadline = NEVER;
+/* bus is owned, the next byte is an address, slave is transmitting */
+static bool owned = false, addressNext = false, reading = false;
+/* scl is pulled low by the recovery */
+static bool sclLow = false;
+/* faults: address bytes to nack and to lose arbitration on, clock pulses
+ * sda is held low for */
+static unsigned int nackCount, arbCount, stuckClocks;
+/* start conditions sent, i.e. attempts; repeated starts do not count */
+static unsigned int starts;
+/* result of the request */
+static twStatus result;
+static uint32_t doneAt;
+
+static unsigned int failed = 0;
+
+void shutdownError () {
+	puts ("shutdownError");
+	exit (EXIT_FAILURE);
+}
+
+void timerSetCallback (const timerChannel c, const timerCallback cb) {
+	if (c == TIMER_I2C) {
+		timerCb = cb;
+	}
+}
+
+void timerStartTicks (const timerChannel c, const uint16_t ticks) {
+	if (c == TIMER_I2C) {
+		timerDeadline = now + ticks*TIMER_US_PER_TICK;
+	}
+}
+
+void timerStop (const timerChannel c) {
+	if (c == TIMER_I2C) {
+		timerDeadline = NEVER;
+	}
+}
+
+bool timerRunning (const timerChannel c) {
+	return c == TIMER_I2C && timerDeadline != NEVER;
+}
+
+uint16_t timerNow () {
+	return now/TIMER_US_PER_TICK;
+}
+
+void powerHold (const powerResource r __unused__, bool * const held,
+		const bool need) {
+	*held = need;
+}
+
+void clockHold (bool * const held, const bool need) {
+	*held = need;
+}
+
+clockSpeed clockCurrent () {
+	return fast ? CLOCK_FAST : CLOCK_SLOW;
+}
+
+/*	Duration of n scl periods (us)
+ */
+static uint32_t twiBits (const unsigned int n) {
+	return n*(1000000/(CLOCK_HZ (clockCurrent ())/(16+2*TWBR)));
+}
+
+/*	Pick up register writes of the engine: a disabled twi or a new action.
+ *	Updates the pins.
+ */
+static void twiPoll () {
+	if (!(TWCR & (1 << TWEN))) {
+		/* switched off, transfers are aborted */
+		twiDeadline = NEVER;
+		owned = false;
+		TWSR = TW_NO_INFO;
+	} else if (TWCR & (1 << TWINT)) {
+		/* writing twint starts the next action and clears it */
+		twiCtrl = TWCR;
+		twiData = TWDR;
+		TWCR &= ~(1 << TWINT);
+		if ((twiCtrl & (1 << TWSTA)) && stuckClocks > 0) {
+			/* the bus never becomes free */
+			twiDeadline = NEVER;
+		} else if (twiCtrl & ((1 << TWSTA) | (1 << TWSTO))) {
+			twiDeadline = now + twiBits (1);
+		} else {
+			twiDeadline = now + twiBits (9);
+		}
+	}
+
+	/* open-drain with pull-ups, a stuck slave lets go of sda after some
+	 * clock pulses */
+	const bool scl = !(DDRC & (1 << DDC5));
+	if (scl && sclLow && stuckClocks > 0) {
+		--stuckClocks;
+	}
+	sclLow = !scl;
+	const bool sda = !(DDRC & (1 << DDC4)) && stuckClocks == 0;
+	PINC = (scl ? (1 << PINC5) : 0) | (sda ? (1 << PINC4) : 0);
+}
+
+/*	Finish the twi action, post its status and run the interrupt handler
+ */
+static void twiComplete () {
+	const uint8_t c = twiCtrl;
+	twiDeadline = NEVER;
+	if (c & (1 << TWSTO)) {
+		owned = false;
+		TWCR &= ~(1 << TWSTO);
+		if (!(c & (1 << TWSTA))) {
+			/* no interrupt for stop */
+			TWSR = TW_NO_INFO;
+			return;
+		}
+	}
+
+	uint8_t s;
+	if (c & (1 << TWSTA)) {
+		if (owned) {
+			s = TW_REP_START;
+		} else {
+			s = TW_START;
+			++starts;
+		}
+		owned = true;
+		addressNext = true;
+	} else if (addressNext) {
+		addressNext = false;
+		reading = twiData & TW_READ;
+		if (arbCount > 0) {
+			--arbCount;
+			owned = false;
+			s = TW_MT_ARB_LOST;
+		} else if (nackCount > 0) {
+			--nackCount;
+			s = reading ? TW_MR_SLA_NACK : TW_MT_SLA_NACK;
+		} else {
+			s = reading ? TW_MR_SLA_ACK : TW_MT_SLA_ACK;
+		}
+	} else if (reading) {
+		TWDR = 0x5a;
+		s = (c & (1 << TWEA)) ? TW_MR_DATA_ACK : TW_MR_DATA_NACK;
+	} else {
+		s = TW_MT_DATA_ACK;
+	}
+	TWSR = s;
+	TWCR |= (1 << TWINT);
+	if (TWCR & (1 << TWIE)) {
+		TWI_vect ();
+	}
+}
+
+/*	Run the simulation until nothing is pending or one second passed
+ */
+static void run () {
+	const uint32_t limit = now + 1000000;
+	twiPoll ();
+	while (true) {
+		const uint32_t next = twiDeadline < timerDeadline ? twiDeadline :
+				timerDeadline;
+		if (next == NEVER || next > limit) {
+			break;
+		}
+		now = next;
+		if (next == twiDeadline) {
+			twiComplete ();
+		} else {
+			timerDeadline = NEVER;
+			timerCb ();
+		}
+		twiPoll ();
+	}
+}
+
+static void done (const twStatus s) {
+	result = s;
+	doneAt = now;
+}
+
+/*	Run a request of mode with faults injected, check its result and the
+ *	number of attempts, and that the time it took stays below limit (us).
+ *	Returns the time.
+ */
+static uint32_t transfer (const char * const what, const twMode mode,
+		const unsigned int nack, const unsigned int arb,
+		const unsigned int stuck, const twStatus want,
+		const unsigned int attempts, const uint32_t limit) {
+	uint8_t data[2] = {0x12, 0x34};
+	nackCount = nack;
+	arbCount = arb;
+	stuckClocks = stuck;
+	starts = 0;
+	result = TWST_WAIT;
+	const uint32_t begin = now;
+	twRequest (mode, 0x30, 0x20, data, sizeof (data), done);
+	run ();
+	const uint32_t took = doneAt - begin;
+
+	printf ("%-28s %-4s %u starts %6lu us\n", what,
+			result == TWST_OK ? "ok" : result == TWST_ERR ? "err" : "wait",
+			starts, (unsigned long) took);
+	if (result != want || starts != attempts || took > limit) {
+		printf ("  expected %s, %u starts, at most %lu us\n",
+				want == TWST_OK ? "ok" : "err", attempts,
+				(unsigned long) limit);
+		++failed;
+	}
+	if (state != TW_IDLE || held || fast) {
+		puts ("  twi not released");
+		++failed;
+	}
+	return took;
+}
+
+int main () {
+	twInit ();
+
+	const uint32_t tick = TIMER_US_PER_TICK;
+	/* a recovery takes at most nine clock pulses, stop and one more half
+	 * period; an idle bus needs the stop only */
+	const uint32_t recoverMax = (TW_RECOVER_DONE+1)*TW_RECOVER_TICKS*tick;
+	const uint32_t recoverIdle = (4+1)*TW_RECOVER_TICKS*tick;
+	/* first retry backoff */
+	const uint32_t backoff = (uint32_t) (TW_MS (1) << 1)*tick;
+	const uint32_t timeout = (uint32_t) TW_MS (TW_TIMEOUT)*tick;
+
+	/* one tick of slack for every timer step */
+	const uint32_t w = transfer ("write", TWM_WRITE, 0, 0, 0, TWST_OK, 1,
+			(uint32_t) 10*tick);
+	const uint32_t r = transfer ("read", TWM_READ, 0, 0, 0, TWST_OK, 1,
+			(uint32_t) 10*tick);
+	transfer ("write, nack", TWM_WRITE, 1, 0, 0, TWST_OK, 2,
+			2*w + recoverIdle + backoff + tick);
+	transfer ("read, nack", TWM_READ, 1, 0, 0, TWST_OK, 2,
+			2*r + recoverIdle + backoff + tick);
+	transfer ("write, arbitration lost", TWM_WRITE, 0, 1, 0, TWST_OK, 2,
+			2*w + recoverIdle + backoff + tick);
+	transfer ("write, sda stuck 5 clocks", TWM_WRITE, 0, 0, 5, TWST_OK, 1,
+			timeout + recoverMax + backoff + w + 2*tick);
+	/* every attempt fails, backoff doubles from 2 ms */
+	uint32_t giveUp = 0;
+	for (uint8_t i = 1; i < TW_RETRIES; i++) {
+		giveUp += (uint32_t) (TW_MS (1) << i)*tick;
+	}
+	giveUp += TW_RETRIES*(w + recoverIdle + tick);
+	transfer ("write, nack always", TWM_WRITE, TW_RETRIES, 0, 0, TWST_ERR,
+			TW_RETRIES, giveUp);
+
+	return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
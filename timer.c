@@ -25,101 +25,464 @@ THE SOFTWARE.
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/wdt.h>
 
 #include "timer.h"
+#include "power.h"
 
-/* prescaler is 1024 */
-#define PRESCALER ((1 << CS12) | (1 << CS10))
-
-#if F_CPU == 1000000
-/* with divider 1024 each tick is 1024us */
-#define US_PER_TICK 1024
-#define MAX_US ((uint32_t) 67107840)
-#elif F_CPU == 8000000
-/* with divider 1024 each clock tick is 128us with a rounding error of 64us
- * per second/4ms per minute, since it’s a 16 bit timer we support up to
- * 2**16-1 ticks, which is 8388480us (8s) */
-#define US_PER_TICK 128
-#define MAX_US ((uint32_t) 8388480)
-#else
+#include <util/atomic.h>
+
+/* prescaler is 1024 at the fast clock and scaled down with the slow one, a
+ * tick has the same length at both */
+#define DIVIDER_SLOW (1024/CLOCK_SCALE)
+#if CLOCK_CS01 (DIVIDER_SLOW) == 0
 #error "cpu speed not supported"
 #endif
+static const uint8_t prescalers[CLOCK_SPEEDS] = {CLOCK_CS01 (DIVIDER_SLOW),
+		CLOCK_CS01 (1024)};
+
+/* ms*TIMER_TICKS_NUM must fit into 32 bits */
+#define MAX_MS (UINT32_MAX/TIMER_TICKS_NUM)
+
+/* watchdog interrupt period, 32k cycles of the 128 kHz oscillator (~250 ms) */
+#define WDT_PRESCALER (1 << WDP2)
+#define WDT_CYCLES ((uint32_t) 32768)
+/* nominal period in ticks, 1/16 ticks */
+#define WDT_TICKS_NOMINAL ((uint16_t) (WDT_CYCLES*1000000*16/128000/TIMER_US_PER_TICK))
+/* recalibrate against timer1 every 64 periods (~16 s) */
+#define WDT_CALIBRATE_INTERVAL 64
+
+/* a virtual timer; times are in ticks, extended to 32 bits by the overflow
+ * counter */
+typedef struct {
+	/* next hit */
+	uint32_t deadline;
+	/* period, whole ticks and fraction periodFrac/fracDen ticks, which is
+	 * accumulated in frac */
+	uint32_t periodTicks, periodFrac, fracDen, frac;
+	/* periods elapsed since the last call to timerHit */
+	uint16_t hits;
+	bool oneshot;
+	timerCallback callback;
+} timerSlot;
+
+static timerSlot slots[TIMER_CHANNELS];
+/* channel posts no wakeup, it is driven by its callback only */
+#define NOWAKE 0xff
+/* wakeup bit posted by each channel, unless it has a callback */
+static const uint8_t wakebits[TIMER_CHANNELS] = {WAKE_TIMER, NOWAKE,
+		WAKE_TIMER_ALARM, NOWAKE, NOWAKE, NOWAKE};
+/* running channels, sorted by deadline */
+static uint8_t queue[TIMER_CHANNELS];
+static uint8_t queued = 0;
+/* upper 16 bits of timer1 */
+static uint16_t epoch = 0;
+/* time spent in power-down, when timer1 does not count */
+static uint32_t skew = 0;
+/* channels whose callback is due, callbacks are running */
+static uint8_t pending = 0;
+static bool calling = false;
+
+/* watchdog timebase: running, timer1 count at the last interrupt is valid,
+ * cpu was powered down since the last interrupt */
+static bool wdtRunning = false, wdtValid = false, wdtSlept = false;
+/* counter of periods until the next calibration, 0 if due */
+static uint8_t wdtCalibrate = 0;
+/* timer1 count at the start of the period and its length in 1/16 ticks */
+static uint16_t wdtLast, wdtTicks = WDT_TICKS_NOMINAL;
+
+/*	Timer1 count extended to 32 bits, interrupts must be disabled
+ */
+static uint32_t timerRaw32 () {
+	const uint16_t low = TCNT1;
+	uint16_t high = epoch;
+	/* overflow not handled yet */
+	if ((TIFR1 & (1 << TOV1)) && low < 0x8000) {
+		++high;
+	}
+	return ((uint32_t) high << 16) | low;
+}
+
+/*	Current time, interrupts must be disabled
+ */
+static uint32_t timerNow32 () {
+	return timerRaw32 () + skew;
+}
+
+/*	Start or stop the watchdog interrupt, interrupts must be disabled
+ */
+static void timerWdt (const bool enable) {
+	if (enable == wdtRunning) {
+		return;
+	}
+	/* timed sequence, prescaler changes need it */
+	WDTCSR = (1 << WDCE) | (1 << WDE);
+	WDTCSR = enable ? ((1 << WDIE) | WDT_PRESCALER) : 0;
+	wdtRunning = enable;
+	wdtValid = false;
+	wdtSlept = false;
+	wdtCalibrate = 0;
+}
+
+/*	Remove channel from the queue, if it is running
+ */
+static void timerRemove (const timerChannel c) {
+	uint8_t j = 0;
+	for (uint8_t i = 0; i < queued; i++) {
+		if (queue[i] != c) {
+			queue[j++] = queue[i];
+		}
+	}
+	queued = j;
+}
+
+/*	Sorted insert by deadline; the set is tiny, so a linear search is fine
+ */
+static void timerInsert (const timerChannel c) {
+	const uint32_t deadline = slots[c].deadline;
+	uint8_t i = queued;
+	while (i > 0 && (int32_t) (deadline - slots[queue[i-1]].deadline) < 0) {
+		queue[i] = queue[i-1];
+		--i;
+	}
+	queue[i] = c;
+	++queued;
+}
+
+/*	Fire the first timer in the queue and re-queue it if periodic. Its
+ *	callback is only marked, see timerCallbacks.
+ */
+static void timerFire () {
+	const timerChannel c = queue[0];
+	timerSlot * const t = &slots[c];
+	timerRemove (c);
 
-/* max/current timer hits */
-static volatile uint8_t maxhits, hits;
-/* compare value for n-1, last hits */
-static uint16_t count, lastcount;
-/* accumulated time since last timeout/call to timerHit (us) */
-static uint32_t time;
-static bool oneshot = false;
+	++t->hits;
+	if (!t->oneshot) {
+		/* next period, carry rounding errors forward */
+		t->deadline += t->periodTicks;
+		t->frac += t->periodFrac;
+		if (t->frac >= t->fracDen) {
+			t->frac -= t->fracDen;
+			++t->deadline;
+		}
+		timerInsert (c);
+	}
+
+	if (t->callback != NULL) {
+		pending |= (1 << c);
+	} else if (wakebits[c] != NOWAKE) {
+		enableWakeup (wakebits[c]);
+	}
+}
+
+/*	Fire expired timers and program the compare unit for the next deadline.
+ *	Deadlines more than one counter range ahead are handled by the overflow
+ *	interrupt. A timer may fire up to one tick early, because a compare value
+ *	right behind the counter could be missed. Interrupts must be disabled.
+ */
+static void timerSchedule () {
+	/* keeps time while powered down */
+	timerWdt (queued > 0);
+	while (queued > 0) {
+		const uint32_t deadline = slots[queue[0]].deadline;
+		const int32_t left = deadline - timerNow32 ();
+		if (left <= 1) {
+			timerFire ();
+		} else {
+			if (left <= UINT16_MAX) {
+				OCR1A = deadline - skew;
+				/* clear pending match */
+				TIFR1 = (1 << OCF1A);
+				TIMSK1 |= (1 << OCIE1A);
+			} else {
+				TIMSK1 &= ~(1 << OCIE1A);
+			}
+			return;
+		}
+	}
+	TIMSK1 &= ~(1 << OCIE1A);
+}
+
+/*	Run the callbacks of fired channels with interrupts enabled, so they do
+ *	not delay the pwm interrupt. Callbacks do not nest, channels fired in the
+ *	meantime are run by the outer call. Interrupts must be disabled.
+ */
+static void timerCallbacks () {
+	if (calling) {
+		return;
+	}
+	calling = true;
+	while (pending != 0) {
+		const uint8_t p = pending;
+		pending = 0;
+		sei ();
+		for (timerChannel c = 0; c < TIMER_CHANNELS; c++) {
+			if ((p >> c) & 0x1) {
+				slots[c].callback ();
+			}
+		}
+		cli ();
+	}
+	calling = false;
+}
+
+/*	Callbacks fired outside of the timer interrupts, i.e. by a start or stop,
+ *	run from a compare match right away. Interrupts must be disabled.
+ */
+static void timerKick () {
+	if (pending != 0 && !calling) {
+		OCR1A = TCNT1 + 2;
+		TIFR1 = (1 << OCF1A);
+		TIMSK1 |= (1 << OCIE1A);
+	}
+}
 
 ISR(TIMER1_COMPA_vect) {
-	++hits;
-	time += (uint32_t) OCR1A * (uint32_t) US_PER_TICK;
-	if (hits == maxhits-1) {
-		OCR1A = lastcount;
-	} else if (hits >= maxhits) {
-		enableWakeup (WAKE_TIMER);
-		if (oneshot) {
-			timerStop ();
+	timerSchedule ();
+	timerCallbacks ();
+}
+
+ISR(TIMER1_OVF_vect) {
+	++epoch;
+	timerSchedule ();
+	timerCallbacks ();
+}
+
+/*	Watchdog period. Timer1 measures the part of it the cpu was awake; if it
+ *	was powered down the remainder is added to the time, otherwise the period
+ *	is used to calibrate the watchdog oscillator.
+ */
+ISR(WDT_vect) {
+	const uint32_t raw = timerRaw32 ();
+	const uint16_t now = raw;
+	const uint16_t awake = now - wdtLast;
+	wdtLast = now;
+
+	if (wdtValid) {
+		if (wdtSlept) {
+			skew += ((wdtTicks + 8) >> 4) - awake;
+			if (wdtCalibrate > 0) {
+				--wdtCalibrate;
+			}
+		} else {
+			/* exponential moving average, 1/4 */
+			wdtTicks += (int16_t) ((awake << 4) - wdtTicks) >> 2;
+			wdtCalibrate = WDT_CALIBRATE_INTERVAL;
+		}
+	}
+	wdtValid = true;
+	wdtSlept = false;
+
+	timerSchedule ();
+	timerCallbacks ();
+}
+
+/*	Check whether the timer service can keep time while the cpu is powered
+ *	down and mark the current watchdog period as slept if so. Timers then fire
+ *	on the next watchdog interrupt after their deadline, so power-down is
+ *	refused if the next deadline is closer than one period. After
+ *	WDT_CALIBRATE_INTERVAL slept periods one period must be spent awake to
+ *	recalibrate. With calibration the error is bounded by the tick resolution
+ *	of a period (<0.1%) plus oscillator drift within one calibration
+ *	interval, and half a period for each wakeup by another interrupt, see
+ *	timerWake. Interrupts must be disabled.
+ */
+bool timerPowerDown () {
+	if (pending != 0) {
+		return false;
+	}
+	if (queued == 0) {
+		return true;
+	}
+	if (!wdtValid || wdtCalibrate == 0) {
+		return false;
+	}
+	const int32_t left = slots[queue[0]].deadline - timerNow32 ();
+	if (left <= (int32_t) (wdtTicks >> 4)) {
+		return false;
+	}
+	wdtSlept = true;
+	return true;
+}
+
+/*	Cpu woke up after timerPowerDown. Unless the watchdog interrupt woke it,
+ *	the time lags behind by the slept part of the current period, which is
+ *	not known. The period is restarted and half of what was left of it is
+ *	added, so the time is off by at most half a period and new timers are
+ *	not delayed until the period ends. Interrupts must be disabled.
+ */
+void timerWake () {
+	if (!wdtSlept) {
+		return;
+	}
+	wdt_reset ();
+	const uint32_t raw = timerRaw32 ();
+	const uint16_t awake = (uint16_t) raw - wdtLast;
+	const uint16_t period = (wdtTicks + 8) >> 4;
+	if (awake < period) {
+		skew += (period - awake) >> 1;
+	}
+	wdtLast = raw;
+	wdtSlept = false;
+	/* deadlines may have passed */
+	timerSchedule ();
+	timerKick ();
+}
+
+void timerInit () {
+	/* the timebase is never released */
+	powerAcquire (POWER_TIMER1);
+	/* normal mode, free-running */
+	TCCR1A = 0;
+	TCCR1B = prescalers[clockCurrent ()];
+	/* extend time to 32 bits */
+	TIMSK1 = (1 << TOIE1);
+}
+
+/*	Cpu clock changed to s, called by the clock manager with interrupts
+ *	disabled
+ */
+void timerClock (const clockSpeed s) {
+	TCCR1B = prescalers[s];
+}
+
+/*	Current timer count, TIMER_US_PER_TICK each; wraps around
+ */
+uint16_t timerNow () {
+	uint16_t ret;
+	/* 16 bit access uses a temporary register shared with the isr */
+	ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+		ret = TCNT1;
+	}
+	return ret;
+}
+
+/*	Call cb from interrupt context when channel c is hit, instead of posting
+ *	a wakeup. It runs with interrupts enabled, after the timer interrupt is
+ *	done.
+ */
+void timerSetCallback (const timerChannel c, const timerCallback cb) {
+	assert (c < TIMER_CHANNELS);
+	ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+		slots[c].callback = cb;
+	}
+}
+
+/*	Check if timer c is running, i.e. started and not fired yet or periodic
+ */
+bool timerRunning (const timerChannel c) {
+	assert (c < TIMER_CHANNELS);
+	bool ret = false;
+	ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+		for (uint8_t i = 0; i < queued; i++) {
+			ret = ret || queue[i] == c;
 		}
 	}
+	return ret;
 }
 
-/*	Check if timer was hit, return time since last restart or 0 if not hit yet
+/*	Check if timer c was hit, return number of periods elapsed since the last
+ *	call or 0 if not hit yet
  */
-uint32_t timerHit () {
-	uint32_t ret = 0;
+uint16_t timerHit (const timerChannel c) {
+	assert (c < TIMER_CHANNELS);
+	uint16_t ret = 0;
+	if (wakebits[c] == NOWAKE) {
+		/* callback channel, its hits are not counted */
+		return ret;
+	}
 	ATOMIC_BLOCK (ATOMIC_FORCEON) {
-		if (shouldWakeup (WAKE_TIMER)) {
-			disableWakeup (WAKE_TIMER);
-
-			ret = time;
-			if (!oneshot) {
-				/* reset timer, start again */
-				hits = 0;
-				time = 0;
-				OCR1A = count;
-				TCNT1 = 0;
-			}
+		if (shouldWakeup (wakebits[c])) {
+			ret = slots[c].hits;
+			slots[c].hits = 0;
+			disableWakeup (wakebits[c]);
 		}
 	}
 	return ret;
 }
 
-/*	Start a timer that fires every t us
+/*	Start timer c that fires steps times during ms, i.e. with a period of
+ *	ms/steps, which does not need to be a multiple of the tick length. A
+ *	running timer is restarted.
  */
-void timerStart (const uint32_t t, const bool once) {
-	oneshot = once;
-	hits = 0;
-	time = 0;
+void timerStartSteps (const timerChannel c, const uint32_t ms,
+		const uint16_t steps, const bool once) {
+	assert (c < TIMER_CHANNELS);
+	assert (ms <= MAX_MS);
+	assert (steps > 0);
 
-	/* reset timer value */
-	TCNT1 = 0;
-	/* set ctc (compare timer and clear) mode (part 1) */
-	TCCR1A = 0;
-	/* enable compare match interrupt */
-	TIMSK1 = (1 << OCIE1A);
-	/* set compare value */
-	if (t >= MAX_US) {
-		maxhits = t/MAX_US+1;
-		count = UINT16_MAX;
-		lastcount = (t % MAX_US) / US_PER_TICK;
-		OCR1A = UINT16_MAX;
-	} else {
-		maxhits = 1;
-		const uint16_t tdiv = t / US_PER_TICK;
-		count = tdiv;
-		lastcount = tdiv;
-		OCR1A = tdiv;
-	}
-
-	/* prescaler and ctc (part 2) */
-	TCCR1B = PRESCALER | (1 << WGM12);
-}
-
-void timerStop () {
-	/* zero clock source */
-	TCCR1B = 0;
+	const uint32_t num = ms*TIMER_TICKS_NUM;
+	const uint32_t den = (uint32_t) TIMER_TICKS_DEN*steps;
+	uint32_t ticks = num/den, rem = num%den;
+	if (ticks == 0) {
+		ticks = 1;
+		rem = 0;
+	}
+
+	if (slots[c].callback == NULL && wakebits[c] != NOWAKE) {
+		disableWakeup (wakebits[c]);
+	}
+	/* may be called from a callback */
+	ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+		timerSlot * const t = &slots[c];
+		timerRemove (c);
+		t->oneshot = once;
+		t->hits = 0;
+		t->periodTicks = ticks;
+		t->periodFrac = rem;
+		t->fracDen = den;
+		t->frac = 0;
+		t->deadline = timerNow32 () + ticks;
+		pending &= ~(1 << c);
+		timerInsert (c);
+		timerSchedule ();
+		timerKick ();
+	}
+}
+
+/*	Start one-shot timer c that fires after ticks, without the divisions of
+ *	timerStartSteps; for short timeouts set from interrupt context
+ */
+void timerStartTicks (const timerChannel c, const uint16_t ticks) {
+	assert (c < TIMER_CHANNELS);
+	assert (ticks > 0);
+
+	if (slots[c].callback == NULL && wakebits[c] != NOWAKE) {
+		disableWakeup (wakebits[c]);
+	}
+	ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+		timerSlot * const t = &slots[c];
+		timerRemove (c);
+		t->oneshot = true;
+		t->hits = 0;
+		t->deadline = timerNow32 () + ticks;
+		pending &= ~(1 << c);
+		timerInsert (c);
+		timerSchedule ();
+		timerKick ();
+	}
+}
+
+/*	Start timer c that fires every ms
+ */
+void timerStart (const timerChannel c, const uint32_t ms, const bool once) {
+	timerStartSteps (c, ms, 1, once);
+}
+
+/*	Stop timer c and drop pending hits, the counter keeps running and timerNow
+ *	stays valid
+ */
+void timerStop (const timerChannel c) {
+	assert (c < TIMER_CHANNELS);
+	if (slots[c].callback == NULL && wakebits[c] != NOWAKE) {
+		disableWakeup (wakebits[c]);
+	}
+	ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+		timerRemove (c);
+		pending &= ~(1 << c);
+		timerSchedule ();
+		timerKick ();
+	}
 }
 
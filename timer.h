@@ -27,9 +27,55 @@ THE SOFTWARE.
 #include <stdint.h>
 #include <stdbool.h>
 
-void timerStart (const uint32_t t, const bool);
-uint32_t timerHit ();
-void timerStop ();
+#include "common.h"
+#include "clock.h"
+
+/* timer1 tick length, ms to ticks is ms*TIMER_TICKS_NUM/TIMER_TICKS_DEN. One
+ * tick is 1024 cycles of the fast clock and 1024/CLOCK_SCALE of the slow one,
+ * i.e. 256 us at 1 and 4 MHz, 128 us at 2 and 8 MHz. */
+#define TIMER_US_PER_TICK ((uint32_t) (1024UL*1000000/CLOCK_HZ (CLOCK_FAST)))
+#define TIMER_TICKS_NUM 125
+#define TIMER_TICKS_DEN (TIMER_US_PER_TICK/8)
+#if 1024*1000000 % CLOCK_HZ (CLOCK_FAST) != 0 || \
+		(1024*1000000/CLOCK_HZ (CLOCK_FAST)) % 8 != 0
+#error "cpu speed not supported, ticks must be a multiple of 8 us"
+#endif
+/* ms to ticks, for constants */
+#define TIMER_MS_TICKS(ms) ((uint32_t) (ms)*TIMER_TICKS_NUM/TIMER_TICKS_DEN)
+
+/* virtual timers, all driven by timer1 */
+typedef uint8_t timerChannel;
+/* ui timeouts and run steps, posts WAKE_TIMER */
+#define TIMER_UI 0
+/* speaker note length, callback only */
+#define TIMER_SPEAKER 1
+/* alarm auto-stop, posts WAKE_TIMER_ALARM */
+#define TIMER_ALARM 2
+/* i2c timeouts, callback only */
+#define TIMER_I2C 3
+/* battery measurements, callback only */
+#define TIMER_BATTERY 4
+/* LED cross-fade steps, callback only */
+#define TIMER_PWM 5
+#define TIMER_CHANNELS 6
+
+/* called from interrupt context, with interrupts enabled, instead of posting a
+ * wakeup */
+typedef void (*timerCallback) ();
+
+void timerInit ();
+void timerClock (const clockSpeed);
+uint16_t timerNow ();
+void timerSetCallback (const timerChannel, const timerCallback);
+void timerStart (const timerChannel, const uint32_t, const bool);
+void timerStartSteps (const timerChannel, const uint32_t, const uint16_t,
+		const bool);
+void timerStartTicks (const timerChannel, const uint16_t);
+bool timerRunning (const timerChannel);
+uint16_t timerHit (const timerChannel);
+void timerStop (const timerChannel);
+bool timerPowerDown ();
+void timerWake ();
 
 #endif /* TIMER_H */
 
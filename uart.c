@@ -25,16 +25,81 @@ THE SOFTWARE.
 
 #include <stdio.h>
 #include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
 
 #include "uart.h"
+#include "power.h"
+#include "clock.h"
+
+/* 38.4k needs 8 MHz, otherwise the error is too large */
+#if F_CPU >= 8000000
+#define UART_BAUD 38400UL
+#else
+#define UART_BAUD 9600UL
+#endif
+/* within 2% at both clock speeds */
+#define UART_BAUD_OK(f) (CLOCK_BAUD (f, UART_BAUD)*50 >= UART_BAUD*49 && \
+		CLOCK_BAUD (f, UART_BAUD)*50 <= UART_BAUD*51 && \
+		CLOCK_UBRR (f, UART_BAUD) <= 255)
+#if !UART_BAUD_OK (CLOCK_HZ (CLOCK_SLOW)) || !UART_BAUD_OK (CLOCK_HZ (CLOCK_FAST))
+#error "baud rate not supported"
+#endif
+static const uint8_t ubrr[CLOCK_SPEEDS] = {
+		CLOCK_UBRR (CLOCK_HZ (CLOCK_SLOW), UART_BAUD),
+		CLOCK_UBRR (CLOCK_HZ (CLOCK_FAST), UART_BAUD)};
+
+/* usart is acquired and the clock frozen, until the transmitter is done */
+static bool held = false, frozen = false;
+
+/*	Set up baud rate and frame format, after reset and whenever the usart was
+ *	gated
+ */
+static void uartSetup () {
+	UBRR0H = 0;
+	UBRR0L = ubrr[clockCurrent ()];
+	/* enable double speed mode */
+	UCSR0A = (1 << U2X0);
+	/* Enable receiver and transmitter */
+	UCSR0B = (1 << RXEN0) | (1 << TXEN0);
+	/* Set frame format: 8 data, 1 stop bit, even parity */
+	UCSR0C = (1<<UPM01) | (0 << UPM00) | (0<<USBS0)|(3<<UCSZ00);
+}
 
 /* blocking uart send
  */
 static void uartSend (unsigned char data) {
-	/* Wait for empty transmit buffer */
-	while (!( UCSR0A & (1<<UDRE0)));
-	/* Put data into buffer, sends the data */
-	UDR0 = data;
+	bool done = false;
+	while (!done) {
+		/* the transmit complete interrupt must not release the usart in
+		 * between, it ignores writes while gated */
+		ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+			if (!held) {
+				/* a speed change would garble the frame in transit */
+				clockFreeze (&frozen, true);
+				powerHold (POWER_USART, &held, true);
+				/* registers were lost while gated */
+				uartSetup ();
+			}
+			/* Wait for empty transmit buffer */
+			if (UCSR0A & (1<<UDRE0)) {
+				/* clear transmit complete, keep double speed */
+				UCSR0A = (1 << U2X0) | (1 << TXC0);
+				/* Put data into buffer, sends the data */
+				UDR0 = data;
+				UCSR0B |= (1 << TXCIE0);
+				done = true;
+			}
+		}
+	}
+}
+
+/*	Transmitter is done
+ */
+ISR(USART_TX_vect) {
+	UCSR0B &= ~(1 << TXCIE0);
+	powerHold (POWER_USART, &held, false);
+	clockFreeze (&frozen, false);
 }
 
 static int uartPutc (char c, FILE *stream __unused__) {
@@ -48,25 +113,7 @@ static int uartPutc (char c, FILE *stream __unused__) {
 static FILE mystdout = FDEV_SETUP_STREAM (uartPutc, NULL, _FDEV_SETUP_WRITE);
 
 void uartInit () {
-	UBRR0H = 0;
-#if F_CPU == 1000000
-	/* Set baud rate (9600, double speed) */
-	UBRR0L = 12;
-#elif F_CPU == 4000000
-	/* Set baud rate (9600, double speed) */
-	UBRR0L = 51;
-#elif F_CPU == 8000000
-	/* baudrate 38.4k */
-	UBRR0L = 25;
-#else
-#error "cpu speed not supported"
-#endif
-	/* enable double speed mode */
-	UCSR0A = (1 << U2X0);
-	/* Enable receiver and transmitter */
-	UCSR0B = (1 << RXEN0) | (1 << TXEN0);
-	/* Set frame format: 8 data, 1 stop bit, even parity */
-	UCSR0C = (1<<UPM01) | (0 << UPM00) | (0<<USBS0)|(3<<UCSZ00);
+	uartSetup ();
 
 	/* redirect stdout/stderr */
 	stdout = &mystdout;
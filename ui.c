@@ -25,6 +25,7 @@ THE SOFTWARE.
 
 #include <util/delay.h>
 #include <avr/sleep.h>
+#include <avr/pgmspace.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -33,36 +34,45 @@ THE SOFTWARE.
 #include "gyro.h"
 #include "timer.h"
 #include "pwm.h"
-
-/* keep the lights on for 10 ms */
-#define FLASH_ALARM_ON ((uint32_t) 10*1000)
-/* and wait 500 ms */
-#define FLASH_ALARM_OFF ((uint32_t) 500*1000)
-/* flash 30 times */
-#define FLASH_ALARM_NUM (30)
-
-#define FLASH_ENTER_COARSE_ON ((uint32_t) 50*1000)
-/* time is ignored for ENTER/CONFIRM_COARSE (because _NUM is one), but used for
- * CONFIRM_FINE */
-#define FLASH_ENTER_COARSE_OFF ((uint32_t) 200*1000)
-#define FLASH_ENTER_COARSE_NUM (1)
-
-#define FLASH_CONFIRM_COARSE_ON FLASH_ENTER_COARSE_ON
-#define FLASH_CONFIRM_COARSE_OFF FLASH_ENTER_COARSE_OFF
-#define FLASH_CONFIRM_COARSE_NUM FLASH_ENTER_COARSE_NUM
-
-#define FLASH_CONFIRM_FINE_ON FLASH_ENTER_FINE_ON
-#define FLASH_CONFIRM_FINE_OFF FLASH_ENTER_FINE_OFF
-#define FLASH_CONFIRM_FINE_NUM (2)
+#include "speaker.h"
+#include "power.h"
+#include "i2c.h"
+#include "uart.h"
+#include "battery.h"
+#include "dispatch.h"
+
+/* stop flashing after 15 s, halved for each battery level */
+#define FLASH_ALARM_TIMEOUT ((uint32_t) 15*1000)
+
+/* keep the gyro in sleep mode for 30 s after aborting selection, since it is
+ * likely to be used again soon, power it down afterwards */
+#define GYRO_SLEEP_TIMEOUT ((uint32_t) 30*1000)
+/* enter standby after 2 min in idle mode */
+#define SLEEP_TIMEOUT ((uint32_t) 2*60*1000)
+
+/* select time by tilting the device (accelerometer) instead of rotating it
+ * (gyroscope), which keeps the power-hungry gyro off */
+//#define UI_SELECT_TILT
+
+/* show the run with LEDs fully on or off instead of fading smoothly, which
+ * stops the LED pwm and lets the cpu power down between fade steps */
+//#define UI_RUN_QUANTIZE
 
 /* timer defaults to 3 min upon startup */
-#define DEFAULT_TIMER_VALUE ((uint32_t) 3*60*1000*1000)
+#define DEFAULT_TIMER_VALUE ((uint32_t) 3*60*1000)
+/* the run is divided into PWM_LED_COUNT-1 fades; -1, since two leds’s states
+ * are interleaved */
+#define RUN_FADES (PWM_LED_COUNT-1)
+
+/* fade out the current LED into the next one, pwm posts WAKE_ANIMATION when
+ * done */
+#define runFade() pwmCrossfade (currLed, currLed-1, timerValue/RUN_FADES)
 
 /* UI modes, enum would take 16 bits */
 typedef uint8_t uimode;
 /* initialize */
 #define UIMODE_INIT 0
-/* deep sleep */
+/* deep sleep, only the accelerometer wakes us up */
 #define UIMODE_SLEEP 1
 /* select time */
 #define UIMODE_SELECT_COARSE 2
@@ -72,8 +82,7 @@ typedef uint8_t uimode;
 /* count time */
 #define UIMODE_RUN 5
 /* flash leds */
-#define UIMODE_FLASH_ON 6
-#define UIMODE_FLASH_OFF 7
+#define UIMODE_FLASH 6
 
 /* flash modes */
 typedef uint8_t flashmode;
@@ -83,43 +92,72 @@ typedef uint8_t flashmode;
 #define FLASH_CONFIRM_COARSE 3
 #define FLASH_CONFIRM_FINE 4
 
-/* nextmode is used for deciding which mode _FLASH transitions into */
+/* flash patterns, played by the pwm */
+/* alarm: keep the lights on for 10 ms and wait 500 ms, repeated until
+ * stopped */
+static const pwmKeyframe flashAlarm[] PROGMEM = {
+	{PWM_ALL_LEDS, PWM_MS_FRAMES (10)},
+	{0, PWM_MS_FRAMES (500)},
+	PWM_KEYFRAME_END,
+};
+/* entering/confirming coarse selection: one 50 ms flash */
+static const pwmKeyframe flashCoarse[] PROGMEM = {
+	{PWM_ALL_LEDS, PWM_MS_FRAMES (50)},
+	PWM_KEYFRAME_END,
+};
+/* confirming fine selection: two 50 ms flashes, 200 ms apart */
+static const pwmKeyframe flashFine[] PROGMEM = {
+	{PWM_ALL_LEDS, PWM_MS_FRAMES (50)},
+	{0, PWM_MS_FRAMES (200)},
+	{PWM_ALL_LEDS, PWM_MS_FRAMES (50)},
+	PWM_KEYFRAME_END,
+};
+
+/* fmode is used for deciding which mode _FLASH transitions into */
 static uimode mode = UIMODE_INIT;
 static flashmode fmode = FLASH_NONE;
-static uint8_t flashCount = 0;
 /* Temporary persistence while selecting */
 static signed char coarseValue = 0, fineValue = 0;
-/* Actual elapsed/alarm time in us */
-static uint32_t timerElapsed, timerValue = DEFAULT_TIMER_VALUE;
-static uint8_t brightness[PWM_LED_COUNT];
+/* alarm time in ms */
+static uint32_t timerValue = DEFAULT_TIMER_VALUE;
+/* LED currently fading out */
 static uint8_t currLed;
+/* gyro is in sleep mode while idle, TIMER_UI powers it down */
+static bool gyroSleeping = false;
 static horizon h = HORIZON_NONE;
 static bool horizonChanged = false;
 
-/*	Read sensor values
+/*	Start sensor used for time selection
  */
-static void processSensors () {
-	static bool checkGyro = false;
+static void selectStart () {
+#ifdef UI_SELECT_TILT
+	accelSetTilt (true);
+#else
+	gyroStart ();
+#endif
+}
 
-	/* round-robin to prevent starvation */
-	if (checkGyro) {
-		gyroProcess ();
-		accelProcess();
-	} else {
-		accelProcess ();
-		gyroProcess ();
-	}
-	checkGyro = !checkGyro;
+/*	Stop time selection sensor, gyromode is ignored for tilt selection
+ */
+static void selectStop (const gyroStopMode gyromode __unused__) {
+#ifdef UI_SELECT_TILT
+	accelSetTilt (false);
+#else
+	gyroStop (gyromode);
+#endif
 }
 
-/*	Translate LED ids based on horizon, id 0 is always at the bottom of the
- *	device */
-static uint8_t horizonLed (uint8_t i) {
-	if (h == HORIZON_NEG) {
-		return i;
-	} else {
-		return (PWM_LED_COUNT-1)-i;
-	}
+/*	Get and reset selection steps, i.e. rotation or tilt
+ */
+static int16_t selectTicks () {
+#ifdef UI_SELECT_TILT
+	const int16_t ticks = accelGetTiltTicks ();
+	accelResetTiltTicks ();
+#else
+	const int16_t ticks = gyroGetZTicks ();
+	gyroResetZTicks ();
+#endif
+	return ticks;
 }
 
 static int16_t limits (const int16_t in, const int16_t min, const int16_t max) {
@@ -132,30 +170,62 @@ static int16_t limits (const int16_t in, const int16_t min, const int16_t max) {
 	}
 }
 
-/*	Enter low-power idle mode
+/*	Enter low-power idle mode, gyro is stopped using gyromode
  */
-static void enterIdle () {
+static void enterIdle (const gyroStopMode gyromode) {
 	mode = UIMODE_IDLE;
 
 	pwmStop ();
-	gyroStop ();
+	pwmSetQuantize (false);
+	selectStop (gyromode);
+	timerStop (TIMER_ALARM);
+	gyroSleeping = gyromode == GYRO_SLEEP;
+	timerStart (TIMER_UI, gyroSleeping ? GYRO_SLEEP_TIMEOUT : SLEEP_TIMEOUT,
+			true);
+#ifdef TW_PROFILE
+	/* bus statistics of the previous selection/run */
+	twProfileDump ();
+#endif
+#ifdef PWM_JITTER
+	printf ("pwm jitter %u us\n", pwmJitter ());
+#endif
+#ifdef POWER_PROFILE
+	powerDump ();
+#endif
+#ifdef BATTERY_PROFILE
+	batteryDump ();
+#endif
+}
+
+/*	Enter standby after inactivity. No timer is running, so the watchdog is
+ *	off as well and the cpu stays powered down until the accelerometer’s
+ *	horizon or click interrupt (pin change, works in power-down) fires.
+ *	LEDs and gyro are off already.
+ */
+static void enterSleep () {
+	mode = UIMODE_SLEEP;
+	timerStop (TIMER_UI);
+	timerStop (TIMER_ALARM);
+	speakerStop ();
+	batteryStop ();
 }
 
 static void enterFlash (const flashmode next) {
 	fmode = next;
-	mode = UIMODE_FLASH_ON;
-	for (uint8_t i = 0; i < PWM_LED_COUNT; i++) {
-		pwmSet (i, PWM_ON);
-	}
+	mode = UIMODE_FLASH;
+	pwmSetQuantize (false);
 	switch (fmode) {
 		case FLASH_ALARM:
-			timerStart (FLASH_ALARM_ON, true);
+			pwmPlay (flashAlarm, 0);
 			break;
 
 		case FLASH_ENTER_COARSE:
 		case FLASH_CONFIRM_COARSE:
+			pwmPlay (flashCoarse, 1);
+			break;
+
 		case FLASH_CONFIRM_FINE:
-			timerStart (FLASH_ENTER_COARSE_ON, true);
+			pwmPlay (flashFine, 1);
 			break;
 
 		default:
@@ -165,11 +235,12 @@ static void enterFlash (const flashmode next) {
 }
 
 static void enterCoarse () {
-	gyroStart ();
+	selectStart ();
 	mode = UIMODE_SELECT_COARSE;
 	speakerStart (SPEAKER_BEEP);
 	/* start with a value of zero */
 	pwmSetOff ();
+	pwmCommit ();
 	coarseValue = 0;
 }
 
@@ -186,14 +257,15 @@ static void setFine (const int8_t value) {
 	if (fineValue >= 0) {
 		pwmSetOff ();
 		for (uint8_t i = 0; i < fineValue; i++) {
-			pwmSet (horizonLed (i), PWM_ON);
+			pwmSet (i, PWM_ON);
 		}
 	} else {
 		pwmSetOff ();
 		for (uint8_t i = 0; i < abs (fineValue); i++) {
-			pwmSet (horizonLed (PWM_LED_COUNT-1-i), PWM_ON);
+			pwmSet (PWM_LED_COUNT-1-i, PWM_ON);
 		}
 	}
+	pwmCommit ();
 }
 
 static void enterFine () {
@@ -208,7 +280,7 @@ static void enterFine () {
 static void doSelectCoarse () {
 	/* abort without setting value */
 	if (horizonChanged) {
-		enterIdle ();
+		enterIdle (GYRO_SLEEP);
 		return;
 	}
 
@@ -219,18 +291,17 @@ static void doSelectCoarse () {
 		return;
 	}
 
-	/* use zticks as seconds */
-	const int16_t zticks = gyroGetZTicks ();
-	if (abs (zticks) > 0) {
-		gyroResetZTicks ();
-		coarseValue = limits(coarseValue + zticks, 0, 6);
+	const int16_t ticks = selectTicks ();
+	if (abs (ticks) > 0) {
+		coarseValue = limits(coarseValue + ticks, 0, 6);
 		/* at least 1 min */
 		fineValue = coarseValue == 0 ? 1 : 0;
 
 		pwmSetOff ();
 		for (uint8_t i = 0; i < coarseValue; i++) {
-			pwmSet (horizonLed (i), PWM_ON);
+			pwmSet (i, PWM_ON);
 		}
+		pwmCommit ();
 	}
 }
 
@@ -239,54 +310,64 @@ static void doSelectCoarse () {
 static void doSelectFine () {
 	/* abort without setting value */
 	if (horizonChanged) {
-		enterIdle ();
+		enterIdle (GYRO_SLEEP);
 		return;
 	}
 
 	if (accelGetShakeCount () >= 1) {
 		/* stop selection, actually set timer */
-		timerValue = coarseValue * (uint32_t) 10*60*1000*1000 +
-				fineValue * (uint32_t) 60*1000*1000;
+		timerValue = coarseValue * (uint32_t) 10*60*1000 +
+				fineValue * (uint32_t) 60*1000;
 		accelResetShakeCount ();
 		speakerStart (SPEAKER_BEEP);
-		gyroStop ();
+		selectStop (GYRO_POWERDOWN);
 
 		enterFlash (FLASH_CONFIRM_FINE);
 		return;
 	}
 
-	/* use zticks as seconds */
-	const int16_t zticks = gyroGetZTicks ();
-	if (abs (zticks) > 0) {
-		gyroResetZTicks ();
-		setFine (fineValue + zticks);
+	const int16_t ticks = selectTicks ();
+	if (abs (ticks) > 0) {
+		setFine (fineValue + ticks);
 	}
 }
 
 /*	Idle function, waits for timer start or select commands
  */
 static void doIdle () {
+	if (timerHit (TIMER_UI) > 0) {
+		if (gyroSleeping) {
+			/* not used again soon */
+			selectStop (GYRO_POWERDOWN);
+			gyroSleeping = false;
+			timerStart (TIMER_UI, SLEEP_TIMEOUT-GYRO_SLEEP_TIMEOUT, true);
+		} else {
+			enterSleep ();
+			return;
+		}
+	}
+
 	if (horizonChanged) {
 		/* start timer */
+#ifdef UI_RUN_QUANTIZE
+		pwmSetQuantize (true);
+#endif
 		pwmSetOff ();
-		for (uint8_t i = 0; i < PWM_LED_COUNT; i++) {
-			brightness[i] = 0;
-		}
 		currLed = PWM_LED_COUNT-1;
-		brightness[currLed] = PWM_MAX_BRIGHTNESS;
-		pwmSet (horizonLed (currLed), brightness[currLed]);
-		/* (PWM_LED_COUNT-1)*PWM_MAX_BRIGHTNESS states; -1, since two leds’s
-		 * states are interleaved */
-		const uint32_t brightnessStep = timerValue/(uint32_t) ((PWM_LED_COUNT-1)*PWM_MAX_BRIGHTNESS);
-
-		timerElapsed = 0;
+		pwmSet (currLed, PWM_MAX_BRIGHTNESS);
+		pwmCommit ();
 
 		mode = UIMODE_RUN;
+		selectStop (GYRO_POWERDOWN);
 		pwmStart ();
-		timerStart (brightnessStep, false);
+		/* the timer is authoritative, the fade just displays progress */
+		timerStart (TIMER_UI, timerValue, true);
+		runFade ();
 		speakerStart (SPEAKER_BEEP);
 	} else if (accelGetShakeCount () >= 1) {
-		/* set timer */
+		/* set timer; the idle timeout is not consumed in flash and select
+		 * modes, enterIdle restarts it */
+		timerStop (TIMER_UI);
 		pwmStart ();
 		accelResetShakeCount ();
 		enterFlash (FLASH_ENTER_COARSE);
@@ -302,130 +383,72 @@ static void doRun () {
 		/* stop timer */
 		speakerStart (SPEAKER_BEEP);
 
-		enterIdle ();
+		enterIdle (GYRO_POWERDOWN);
 		return;
 	}
 
-	const uint32_t t = timerHit ();
-	if (t > 0) {
-		timerElapsed += t;
-		if (timerElapsed >= timerValue) {
-			timerStop ();
-			/* ring the alarm! */
-			speakerStart (SPEAKER_BEEP);
-			enterFlash (FLASH_ALARM);
-		} else if (currLed > 0) {
-			/* one step */
-			--brightness[currLed];
-			pwmSet (horizonLed (currLed), brightness[currLed]);
-			++brightness[currLed-1];
-			pwmSet (horizonLed (currLed-1), brightness[currLed-1]);
-			if (brightness[currLed] == 0 && currLed > 0) {
-				--currLed;
-			}
+	if (timerHit (TIMER_UI) > 0) {
+		/* ring the alarm! */
+		speakerStart (SPEAKER_ALARM);
+		timerStart (TIMER_ALARM, FLASH_ALARM_TIMEOUT >> batteryGetLevel (),
+				true);
+		enterFlash (FLASH_ALARM);
+	} else if (pwmAnimationDone ()) {
+		/* next LED */
+		--currLed;
+		if (currLed > 0) {
+			runFade ();
 		}
 	}
 }
 
-/*	LEDs are currently on. Depending on next mode do something like wait for
- *	horizon change (which stops the alarm) or next wait period
+/*	LEDs are flashing. Depending on fmode wait for horizon change (which
+ *	stops the alarm) or the end of the pattern
  */
-static void doFlashOn () {
-	bool stopFlash = false;
-
-	switch (fmode) {
-		case FLASH_ALARM:
-			if (horizonChanged || accelGetShakeCount () > 0) {
-				accelResetShakeCount ();
-				enterIdle ();
-				stopFlash = true;
-			}
-			break;
-
-		case FLASH_ENTER_COARSE:
-		case FLASH_CONFIRM_COARSE:
-		case FLASH_CONFIRM_FINE:
-			/* pass */
-			break;
-
-		default:
-			assert (0);
-			break;
-	}
-
-	if (!stopFlash) {
-		const uint32_t t = timerHit ();
-		if (t > 0) {
-			++flashCount;
-			mode = UIMODE_FLASH_OFF;
-			pwmSetOff ();
-			switch (fmode) {
-				case FLASH_ALARM:
-					timerStart (FLASH_ALARM_OFF, true);
-					break;
-
-				case FLASH_ENTER_COARSE:
-				case FLASH_CONFIRM_COARSE:
-				case FLASH_CONFIRM_FINE:
-					timerStart (FLASH_ENTER_COARSE_OFF, true);
-					break;
-
-				default:
-					assert (0);
-					break;
-			}
+static void doFlash () {
+	if (fmode == FLASH_ALARM) {
+		if (horizonChanged || accelGetShakeCount () > 0 ||
+					timerHit (TIMER_ALARM) > 0) {
+			accelResetShakeCount ();
+			enterIdle (GYRO_POWERDOWN);
 		}
+		/* the alarm pattern is endless */
+		return;
 	}
-}
-
-/*	LEDs are currently off, waiting next flash period
- */
-static void doFlashOff () {
-	bool stopFlash = false;
 
-	switch (fmode) {
-		case FLASH_ALARM:
-			if (horizonChanged || accelGetShakeCount () > 0 ||
-						flashCount >= FLASH_ALARM_NUM) {
-				accelResetShakeCount ();
-				enterIdle ();
-				stopFlash = true;
-			}
-			break;
-
-		case FLASH_ENTER_COARSE:
-			if (flashCount >= FLASH_ENTER_COARSE_NUM) {
+	if (pwmAnimationDone ()) {
+		pwmSetOff ();
+		pwmCommit ();
+		switch (fmode) {
+			case FLASH_ENTER_COARSE:
 				enterCoarse ();
-				stopFlash = true;
-			}
-			break;
+				break;
 
-		case FLASH_CONFIRM_COARSE:
-			if (flashCount >= FLASH_CONFIRM_COARSE_NUM) {
+			case FLASH_CONFIRM_COARSE:
 				enterFine ();
-				stopFlash = true;
-			}
-			break;
+				break;
 
-		case FLASH_CONFIRM_FINE:
-			if (flashCount >= FLASH_CONFIRM_FINE_NUM) {
-				enterIdle ();
-				stopFlash = true;
-			}
-			break;
+			case FLASH_CONFIRM_FINE:
+				enterIdle (GYRO_POWERDOWN);
+				break;
 
-		default:
-			assert (0);
-			break;
+			default:
+				assert (0);
+				break;
+		}
 	}
+}
 
-	if (!stopFlash) {
-		const uint32_t t = timerHit ();
-		if (t > 0) {
-			enterFlash (fmode);
-		}
-	} else {
-		flashCount = 0;
+/*	Standby, wait for the accelerometer
+ */
+static void doSleep () {
+	if (horizonChanged || accelGetShakeCount () >= 1) {
+		/* handle the event like idle mode does */
+		mode = UIMODE_IDLE;
+		gyroSleeping = false;
+		timerStart (TIMER_UI, SLEEP_TIMEOUT, true);
+		batteryStart ();
+		doIdle ();
 	}
 }
 
@@ -434,26 +457,90 @@ static void doFlashOff () {
 static void doInit () {
 	/* get initial orientation */
 	if (horizonChanged && h != HORIZON_NONE) {
-		enterIdle ();
+		enterIdle (GYRO_POWERDOWN);
 
 #if 0
 		/* debugging */
 		mode = UIMODE_RUN;
-		timerValue = (uint32_t) 60*1000*1000;
-		timerElapsed = 0;
-		/* (PWM_LED_COUNT-1)*PWM_MAX_BRIGHTNESS states; -1, since two leds’s
-		 * states are interleaved */
-		brightnessStep = timerValue/(uint32_t) ((PWM_LED_COUNT-1)*PWM_MAX_BRIGHTNESS);
-		fwrite (&brightnessStep, sizeof (brightnessStep), 1, stdout);
+		timerValue = (uint32_t) 60*1000;
 
 		currLed = PWM_LED_COUNT-1;
-		brightness[currLed] = PWM_MAX_BRIGHTNESS;
-		pwmSet (horizonLed (currLed), brightness[currLed]);
-		timerStart (brightnessStep, false);
+		pwmSet (currLed, PWM_MAX_BRIGHTNESS);
+		pwmCommit ();
+		timerStart (TIMER_UI, timerValue, true);
+		runFade ();
 #endif
 	}
 }
 
+/*	Sensor results, timers or animations changed, run the current mode
+ */
+static void uiProcess () {
+	/* dim LEDs as the battery drains */
+	pwmSetDimming (batteryGetLevel ());
+
+	h = accelGetHorizon (&horizonChanged);
+	if (horizonChanged && h != HORIZON_NONE) {
+		/* LED 0 is always at the bottom of the device */
+		pwmSetOrientation (h == HORIZON_NEG ? PWM_ORIENT_UP :
+				PWM_ORIENT_DOWN);
+	}
+
+	switch (mode) {
+		case UIMODE_INIT:
+			doInit ();
+			break;
+
+		case UIMODE_SELECT_COARSE:
+			doSelectCoarse ();
+			break;
+
+		case UIMODE_SELECT_FINE:
+			doSelectFine ();
+			break;
+
+		case UIMODE_IDLE:
+			doIdle ();
+			break;
+
+		case UIMODE_SLEEP:
+			doSleep ();
+			break;
+
+		case UIMODE_RUN:
+			doRun ();
+			break;
+
+		case UIMODE_FLASH:
+			doFlash ();
+			break;
+
+		default:
+			assert (0 && "invalid ui mode");
+			break;
+	}
+
+#if 0
+	printf ("t=%i, h=%i, s=%i, peak=%u\n", gyroGetZTicks (), h,
+			accelGetShakeCount (), pwmPeakCount ());
+	const int32_t gyroval = gyroGetZAccum ();
+	const int16_t gyroraw = gyroGetZRaw ();
+	printf ("%li - %i\n", gyroval, gyroraw);
+#endif
+}
+
+/* event handlers; the sensor drivers run before the ui, which reads their
+ * results. Each driver also runs when the other one’s i2c request is done,
+ * a request that found the queue full is retried then. */
+#define I2C_EVENTS ((1 << WAKE_ACCEL_I2C) | (1 << WAKE_GYRO_I2C))
+static const dispatchEntry handlers[] = {
+	{(1 << WAKE_ACCEL_HORIZON) | (1 << WAKE_ACCEL_SHAKE) | I2C_EVENTS,
+			accelProcess},
+	{(1 << WAKE_GYRO) | I2C_EVENTS, gyroProcess},
+	{I2C_EVENTS | (1 << WAKE_TIMER) | (1 << WAKE_TIMER_ALARM) |
+			(1 << WAKE_ANIMATION), uiProcess},
+};
+
 /*	Main loop
  */
 void uiLoop () {
@@ -464,7 +551,8 @@ void uiLoop () {
 	uint8_t brightness = 0;
 	while (1) {
 		pwmSetOff ();
-		pwmSet (horizonLed (i), brightness);
+		pwmSet (i, brightness);
+		pwmCommit ();
 		++i;
 		if (i >= PWM_LED_COUNT) {
 			i = 0;
@@ -479,81 +567,42 @@ void uiLoop () {
 
 #if 0
 	/* timer test mode */
-	timerStart ((uint32_t) 10*1000, false);
+	timerStart (TIMER_UI, 10, false);
 	while (1) {
-		uint32_t t;
-		sleepwhile (timerHit () == 0);
+		uint16_t t;
+		sleepwhile (timerHit (TIMER_UI) == 0);
 		puts ("on");
 		fwrite (&t, sizeof (t), 1, stdout);
-		pwmSet (horizonLed (0), PWM_ON);
+		pwmSet (0, PWM_ON);
+		pwmCommit ();
 
-		sleepwhile (timerHit () == 0);
+		sleepwhile (timerHit (TIMER_UI) == 0);
 		puts ("off");
 		fwrite (&t, sizeof (t), 1, stdout);
-		pwmSet (horizonLed (0), PWM_OFF);
+		pwmSet (0, PWM_OFF);
+		pwmCommit ();
 	}
 #endif
 
+	batteryStart ();
+
 	/* startup, test all LED’s */
 	pwmStart ();
 	for (uint8_t i = 0; i < PWM_LED_COUNT; i++) {
 		pwmSet (i, PWM_ON);
 	}
+	pwmCommit ();
+#ifdef PWM_CYCLES
+	/* all LEDs are dimmed, the interrupt runs */
+	pwmCyclesDump ();
+#endif
 	pwmSet (0, PWM_OFF);
+	pwmCommit ();
 	accelStart ();
 	pwmSet (1, PWM_OFF);
+	pwmCommit ();
 
-	while (1) {
-		processSensors ();
-
-		h = accelGetHorizon (&horizonChanged);
-
-		switch (mode) {
-			case UIMODE_INIT:
-				doInit ();
-				break;
-
-			case UIMODE_SELECT_COARSE:
-				doSelectCoarse ();
-				break;
-
-			case UIMODE_SELECT_FINE:
-				doSelectFine ();
-				break;
-
-			case UIMODE_IDLE:
-				doIdle ();
-				break;
-
-			case UIMODE_RUN:
-				doRun ();
-				break;
-
-			case UIMODE_FLASH_ON:
-				doFlashOn ();
-				break;
-
-			case UIMODE_FLASH_OFF:
-				doFlashOff ();
-				break;
-
-			default:
-				assert (0 && "invalid ui mode");
-				break;
-		}
-
-		sleepwhile (wakeup == 0);
-
-#if 0
-		printf ("t=%i, h=%i, s=%i\n", gyroGetZTicks (), h,
-				accelGetShakeCount ());
-		const int32_t gyroval = gyroGetZAccum ();
-		const int16_t gyroraw = gyroGetZRaw ();
-		printf ("%li - %i\n", gyroval, gyroraw);
-#endif
-	}
-
-	timerStop ();
-	pwmStop ();
+	/* does not return */
+	dispatchLoop (handlers, length (handlers));
 }
 